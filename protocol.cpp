@@ -22,9 +22,32 @@
 #include "protocol.h"
 #include "structs.h"
 #include <queue>
-#include <map>
+#include <list>
+#include <charconv>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
 #include <nlohmann/json.hpp>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#if !defined(TCP_CORK) && defined(TCP_NOPUSH)
+#define TCP_CORK TCP_NOPUSH /* The BSD name for it */
+#endif
+#include <cerrno>
+#include <cstddef>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 /******************************************************************************
@@ -55,19 +78,30 @@ const char* RGBthree = "F555";
 
 // from comm.c
 extern char* parse_color(const char* txt, dPtr t);
+extern list<dPtr> descriptor_list;
 
-static void Write(dPtr apDescriptor, const char* apData)
+static void NoteOOB(dPtr apDescriptor)
 {
   if (apDescriptor != NULL && apDescriptor->has_prompt) {
     if (apDescriptor->pProtocol->WriteOOB > 0 || *(apDescriptor->output) == '\0') {
       apDescriptor->pProtocol->WriteOOB = 2;
     }
   }
+}
+
+/* In-band text, which still needs to go through ProtocolOutput() */
+static void Write(dPtr apDescriptor, const char* apData)
+{
+  NoteOOB(apDescriptor);
   write_to_output(apData, apDescriptor);
 }
 
+/* Bugs reported by this thread, so ProtocolOutput() can tell if it did */
+static thread_local unsigned int s_ReportedBugs = 0;
+
 static void ReportBug(const char* apText)
 {
+  ++s_ReportedBugs;
   do_log("%s", apText);
 }
 
@@ -78,94 +112,40 @@ static void InfoMessage(dPtr apDescriptor, const char* apData)
 }
 
 const char COMPRESS_START[] = {(char)IAC, (char)SB, (char)TELOPT_MCCP, (char)IAC, (char)SE, (char)0};
+const char WONT_MCCP3[] = {(char)IAC, (char)WONT, (char)TELOPT_MCCP3, (char)0};
 
+/* Compression is switched on and off by markers in the output queue, so that
+ * what's already queued goes out as it was written, and ProtocolFlush() does
+ * the rest.
+ */
 static void CompressStart(dPtr apDescriptor)
 {
-  /* If your mud uses MCCP (Mud Client Compression Protocol), you need to
-   * call whatever function normally starts compression from here - the
-   * ReportBug() call should then be deleted.
-   *
-   * Otherwise you can just ignore this function.
-   */
+  protocol_t* pProtocol = apDescriptor->pProtocol;
 
-  /* Send start of the compression stream. */
-  write_to_descriptor(apDescriptor->descriptor, COMPRESS_START, NULL);
-  // init compression data
-  apDescriptor->comp = new compr();
-
-  /* Init the compression stream. */
-  apDescriptor->comp->stream = new z_stream();
-  apDescriptor->comp->stream->zalloc = z_alloc;
-  apDescriptor->comp->stream->zfree = z_free;
-  apDescriptor->comp->stream->opaque = Z_NULL;
-  deflateInit(apDescriptor->comp->stream, Z_DEFAULT_COMPRESSION);
-
-  /* Init the compression buffers. */
-
-  apDescriptor->comp->buff_out = new Bytef[SMALL_BUFSIZE]();
-  apDescriptor->comp->total_out = SMALL_BUFSIZE;
-  apDescriptor->comp->size_out = 0;
-  apDescriptor->comp->buff_in = new Bytef[SMALL_BUFSIZE]();
-  apDescriptor->comp->total_in = SMALL_BUFSIZE;
-  apDescriptor->comp->size_in = 0;
-
-  /* Turn compression state on. */
-  apDescriptor->comp->state = 2;
+  pProtocol->OutputQueue.push_back({string(), gmcp_payload_t(), eCHUNK_COMPRESS_START});
+  ++pProtocol->CompressMarkers;
   do_log("MCCP compression successfully negotiated.");
-  // ReportBug( "CompressStart() in protocol.c is being called, but it doesn't
-  // do anything!\n" );
 }
 
 void CompressEnd(dPtr apDescriptor)
 {
-  /* If your mud uses MCCP (Mud Client Compression Protocol), you need to
-   * call whatever function normally starts compression from here - the
-   * ReportBug() call should then be deleted.
-   *
-   * Otherwise you can just ignore this function.
-   */
-
-  unsigned char dummy[1];
-  int len, pending;
-  const char WontMCCP[] = {(char)IAC, (char)WONT, TELOPT_MCCP, '\0'};
-  int derr;
+  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-  if (!apDescriptor->comp)
+  /* Nothing to do unless the stream has started, or is about to */
+  if (pProtocol == NULL || (pProtocol->pDeflate == NULL && pProtocol->CompressMarkers == 0))
     return;
 
-  // Write(apDescriptor, WontMCCP);
-
-  /* Stop compression and free structures. */
-  if (apDescriptor->comp->stream) {
-    pending = apDescriptor->comp->stream->avail_out;
-    apDescriptor->comp->stream->next_out = apDescriptor->comp->buff_out;
-    if ((derr = deflate(apDescriptor->comp->stream, Z_FINISH)) != Z_STREAM_END)
-      do_log("SYSERR: deflate returned %d upon Z_FINISH. (in: %d, out: %d)", derr, apDescriptor->comp->stream->avail_in,
-             apDescriptor->comp->stream->avail_out);
-    else
-      do_log("deflate Z_FINISH completed successfully.");
-
-    pending -= apDescriptor->comp->stream->avail_out;
-    if (pending)
-      write_to_descriptor(apDescriptor->descriptor, (const char*)apDescriptor->comp->buff_out, NULL);
-
-    if ((derr = deflateEnd(apDescriptor->comp->stream)) != Z_OK)
-      do_log("SYSERR: deflateEnd returned %d. (in: %d, out: %d)", derr, apDescriptor->comp->stream->avail_in,
-             apDescriptor->comp->stream->avail_out);
-    else
-      do_log("deflateEnd completed successfully.");
-
-    delete apDescriptor->comp->stream;
-    delete apDescriptor->comp->buff_out;
-    delete apDescriptor->comp->buff_in;
+  /* Or if the last marker queued already ends it */
+  if (pProtocol->CompressMarkers > 0) {
+    auto Chunk = find_if(pProtocol->OutputQueue.rbegin(), pProtocol->OutputQueue.rend(),
+                         [](const output_chunk_t& aChunk) { return aChunk.Type != eCHUNK_DATA; });
+    if (Chunk != pProtocol->OutputQueue.rend() && Chunk->Type == eCHUNK_COMPRESS_END)
+      return;
   }
 
-  delete apDescriptor->comp;
-  apDescriptor->comp = nullptr;
+  pProtocol->OutputQueue.push_back({string(), gmcp_payload_t(), eCHUNK_COMPRESS_END});
+  ++pProtocol->CompressMarkers;
   do_log("MCCP compression disabled.");
-
-  // ReportBug( "CompressEnd() in protocol.c is being called, but it doesn't do
-  // anything!\n" );
 }
 
 /******************************************************************************
@@ -218,6 +198,27 @@ static const char s_Gauge5[] = "\005\002Opponent\002darkred\002OPPONENT_HEALTH\0
 #define gROOM_INFO "Room.Info"
 #define gCONFIG "Config"
 
+/* The names of the gmcp_module_t modules, in the same order */
+static const char* s_GMCPModuleNames[eGMCP_MAX] = {
+    "Core",
+    gGENERAL,
+    gCHAR,
+    gCHAR_NAME,
+    gCHAR_VITALS,
+    gCHAR_STATUSVARS,
+    gCHAR_STATUS,
+    gCHAR_STATS,
+    gCOMBAT,
+    gWORLD,
+    "Room",
+    gROOM_INFO,
+    gCONFIG,
+    "Client.GUI",
+    "Client.Map",
+    "Client.Media",
+    "External.Discord",
+};
+
 static variable_name_t VariableNameTable[eOOB_MAX + 1] = {
     /* General */
     {eOOB_CHARACTER_NAME, gCHAR_NAME, "Name", "name", "CHARACTER_NAME", STRING_READ_ONLY},
@@ -299,34 +300,343 @@ static variable_name_t VariableNameTable[eOOB_MAX + 1] = {
 static int s_Players = 0;
 static time_t s_Uptime = 0;
 
+/* The encoded MSSP response, and the values it was encoded with.  Crawlers
+ * ask for it constantly, but it only changes when one of these does.
+ */
+static gmcp_payload_t s_pMSSP;
+static gmcp_payload_t s_pMSSPText; /* The same, for MSSP-REQUEST */
+static int s_MSSPCounts[6];
+
+/* A crawler that's being answered without a descriptor */
+typedef enum
+{
+  eMSSP_PROBE_WAITING,  /* For it to ask */
+  eMSSP_PROBE_REPLYING, /* Writing the reply */
+  eMSSP_PROBE_DONE      /* To be closed */
+} mssp_probe_state_t;
+
+typedef struct
+{
+  socket_t Socket;
+  mssp_probe_state_t State;
+  time_t Started;
+  string Input;          /* What it's sent so far */
+  gmcp_payload_t pReply; /* Whichever form of the table it asked for */
+  size_t Sent;           /* How much of the reply has been written */
+} mssp_probe_t;
+
+static vector<mssp_probe_t> s_MSSPProbes;
+
+/******************************************************************************
+ OOB file-scope variables.
+ ******************************************************************************/
+
+/* For each variable, the variables that share its GMCP category */
+static oob_mask_t s_OOBCategoryMask[eOOB_MAX];
+
+/* A perfect hash of the variable names, built at startup: each slot holds a
+ * variable_t, or -1.  The size is always a power of two.
+ */
+static vector<int> s_VariableSlots;
+static uint32_t s_VariableSeed = 0;
+
+/* Descriptors that have something for OOBUpdateAll() to send */
+static vector<dPtr> s_DirtyOOB;
+
+/* Prebuilt GMCP text for OOBUpdate(): the message header for each category
+ * (indexed by its first variable) and the quoted key for each variable.
+ */
+static string s_GMCPHeader[eOOB_MAX];
+static string s_GMCPKey[eOOB_MAX];
+
+/* The LIST responses that are the same for everyone */
+typedef enum
+{
+  eLIST_COMMANDS,
+  eLIST_LISTS,
+  eLIST_SENDABLE,
+  eLIST_REPORTABLE,
+  eLIST_CONFIGURABLE,
+  eLIST_GUI,
+  eLIST_MAX
+} oob_list_t;
+
+static const char* s_OOBListNames[eLIST_MAX] = {"COMMANDS",           "LISTS",
+                                                "SENDABLE_VARIABLES", "REPORTABLE_VARIABLES",
+                                                "CONFIGURABLE_VARIABLES", "GUI_VARIABLES"};
+
+/* Each list encoded for GMCP [1] and MSDP [0] the first time it's asked for */
+static gmcp_payload_t s_pOOBLists[eLIST_MAX][2];
+
+/******************************************************************************
+ Negotiation file-scope variables.
+ ******************************************************************************/
+
+/* Hosts whose clients didn't understand the offers made on connection, and
+ * so get the careful negotiation.  The oldest are forgotten first.
+ */
+static unordered_set<string> s_PlainHosts;
+static deque<string> s_PlainHostOrder;
+
+/* What the TTYPE cycle found out about a client, so that it can be skipped
+ * when the same client reconnects from the same host.
+ */
+typedef struct
+{
+  string Key;           /* The host and first TTYPE */
+  int Hits;             /* Times it's been used since it was checked */
+  string ClientID;      /* CLIENT_ID */
+  string ClientVersion; /* CLIENT_VERSION, as a string */
+  int MTTS;             /* CLIENT_VERSION, as a number (the MTTS bits) */
+  int ANSI;             /* ANSI_COLORS */
+  int XTerm;            /* XTERM_256_COLORS */
+  int UTF8;             /* UTF_8 */
+  support_t b256Support;
+} client_fingerprint_t;
+
+/* Most recently used first */
+static list<client_fingerprint_t> s_Fingerprints;
+static unordered_map<string, list<client_fingerprint_t>::iterator> s_FingerprintIndex;
+
+/******************************************************************************
+ Output cache file-scope variables.
+ ******************************************************************************/
+
+/* A rendered copy of some ProtocolOutput() text.  The result depends on the
+ * source text and the user's settings (the caps and MXP version), and may
+ * change the user's bBlockMXP, so that's stored as well.
+ */
+typedef struct
+{
+  size_t Key;          /* Hash of everything below except the result */
+  unsigned int Caps;   /* Colour mode, UTF-8, MXP, MSP and bBlockMXP flags */
+  string MXPVersion;   /* The MXP version it was rendered for */
+  string Source;       /* The original text */
+  string Result;       /* The rendered text */
+  bool bBlockMXPAfter; /* bBlockMXP after rendering */
+} output_cache_t;
+
+/* Most recently used first.  ProtocolOutput() can be called from more than
+ * one thread, so the cache is only touched while holding the mutex.
+ */
+static list<output_cache_t> s_OutputCache;
+static unordered_map<size_t, list<output_cache_t>::iterator> s_OutputCacheIndex;
+static mutex s_OutputCacheMutex;
+
+/* RGBone, RGBtwo and RGBthree when the cache was filled, as the mud can
+ * change them at any time.
+ */
+static string s_OutputCachePrimary;
+
+/* The keys of strings rendered once but not yet cached, one per slot, so a
+ * string only goes in the cache when it turns up again.
+ */
+static size_t s_OutputCacheSeen[MAX_OUTPUT_CACHE_SEEN];
+
+/******************************************************************************
+ Output queue file-scope variables.
+ ******************************************************************************/
+
+/* Running totals for ProtocolFlushStats() */
+static flush_stats_t s_FlushStats;
+
+/******************************************************************************
+ MCCP file-scope variables.
+ ******************************************************************************/
+
+/* The settings for each compress_class_t.  The normal profile is the zlib
+ * default, which needs 256K per stream; the fast one needs 32K.
+ */
+static compress_profile_t s_CompressProfiles[eCOMPRESS_MAX] = {
+    {6, 15, 8, Z_DEFAULT_STRATEGY, ""}, /* eCOMPRESS_NORMAL */
+    {1, 12, 5, Z_DEFAULT_STRATEGY, ""}, /* eCOMPRESS_FAST */
+    {9, 15, 9, Z_DEFAULT_STRATEGY, ""}  /* eCOMPRESS_BEST */
+};
+
+static const char* s_CompressClassNames[eCOMPRESS_MAX] = {"Normal", "Fast", "Best"};
+
+/* Each block z_alloc() hands out has its size in front, so z_free() knows
+ * which list to put it back on.
+ */
+typedef union
+{
+  size_t Size;
+  max_align_t Align;
+} zlib_block_t;
+
+/* Blocks zlib has freed, by size.  Streams can be started and ended from
+ * more than one thread, so the pool is only touched while holding the mutex.
+ */
+static unordered_map<size_t, vector<zlib_block_t*>> s_ZlibPool;
+static zlib_pool_stats_t s_ZlibPoolStats;
+static mutex s_ZlibPoolMutex;
+
+/******************************************************************************
+ Local types.
+ ******************************************************************************/
+
+/* How colour codes are rendered for a particular user */
+typedef enum { eCOLOUR_NONE, eCOLOUR_ANSI, eCOLOUR_XTERM } colour_mode_t;
+
+/* The payloads are read with json::sax_parse(), so no DOM is ever built.  This
+ * ignores everything, so each package just overrides the parts it wants.  Deep
+ * nesting is refused outright, as nothing we accept needs it.
+ */
+struct gmcp_sax_t : json::json_sax_t
+{
+  int Depth = 0; /* How many objects and arrays we're inside */
+
+  bool null() override { return true; }
+  bool boolean(bool) override { return true; }
+  bool number_integer(number_integer_t) override { return true; }
+  bool number_unsigned(number_unsigned_t) override { return true; }
+  bool number_float(number_float_t, const string_t&) override { return true; }
+  bool string(string_t&) override { return true; }
+  bool binary(binary_t&) override { return true; }
+  bool key(string_t&) override { return true; }
+  bool start_object(size_t) override { return ++Depth <= MAX_GMCP_DEPTH; }
+  bool end_object() override { return --Depth >= 0; }
+  bool start_array(size_t) override { return ++Depth <= MAX_GMCP_DEPTH; }
+  bool end_array() override { return --Depth >= 0; }
+  bool parse_error(size_t, const std::string&, const json::exception& aError) override
+  {
+    do_log("JSON Parse Error: %s", aError.what());
+    return false;
+  }
+};
+
 /******************************************************************************
  Local function prototypes.
  ******************************************************************************/
 
 static void Negotiate(dPtr apDescriptor);
+static void NegotiateFallback(protocol_t* apProtocol);
+static bool FingerprintApply(protocol_t* apProtocol);
+static void FingerprintStore(protocol_t* apProtocol);
 static void PerformHandshake(dPtr apDescriptor, char aCmd, char aProtocol);
 static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, int aSize);
+static int ParseInput(dPtr apDescriptor, const char* apData, int aSize, char* apOut, int aOutSize,
+                      ssize_t* apCmdIndex);
+
+static unsigned int OutputCacheCaps(protocol_t* apProtocol, colour_mode_t aColourMode, bool abUseMSP);
+static size_t OutputCacheKey(string_view aData, unsigned int aCaps, const char* apMXPVersion);
+static output_cache_t* OutputCacheFind(size_t aKey, string_view aData, unsigned int aCaps, const char* apMXPVersion);
+static void OutputCacheAdd(size_t aKey, string_view aData, unsigned int aCaps, const char* apMXPVersion,
+                           string_view aResult, bool abBlockMXP);
+
+static void FrameStart(string& aFrame, char aOption);
+static void FrameAppend(string& aFrame, string_view aData);
+static void FrameAppendNumber(string& aFrame, int aValue);
+static void FrameEnd(string& aFrame);
+static void FrameList(string& aFrame, bool abGMCP, const char* apVariable, const char* apValue);
+static const gmcp_payload_t& OOBListPayload(oob_list_t aList, bool abGMCP);
+
+static string& QueueBuffer(dPtr apDescriptor);
+static void Queue(dPtr apDescriptor, string_view aData);
+static void QueueShared(dPtr apDescriptor, const gmcp_payload_t& apPayload);
+static void SetSocketOption(socket_t aSocket, int aOption, int aValue);
+static z_stream* DeflateCreate(const compress_profile_t& aProfile);
+static void Deflate(protocol_t* apProtocol, string_view aData, int aFlush);
+static void DeflateQueue(dPtr apDescriptor, string_view aText);
+static ssize_t FlushDeflated(dPtr apDescriptor, string_view aText);
+static bool CompressFinished(protocol_t* apProtocol);
+static void CompressFinishAll(const vector<dPtr>& aDescriptors);
+static bool OutputOverflow(dPtr apDescriptor);
+
+static bool InflateStart(dPtr apDescriptor);
+static void InflateEnd(protocol_t* apProtocol);
+static int SkipInput(dPtr apDescriptor, const char* apData, int aSize);
+static int InflateInput(dPtr apDescriptor, const char* apData, int aSize, char* apOut, int aOutSize,
+                        ssize_t* apCmdIndex);
 
 static void ParseOOB(dPtr apDescriptor, const char* apData);
 static void ExecuteOOBPair(dPtr apDescriptor, const char* apVariable, const char* apValue);
+static void OOBInit(void);
+static variable_t LookupVariable(string_view aName);
+static oob_mask_t OOBPending(protocol_t* apProtocol);
+static void OOBMarkDirty(dPtr apDescriptor, oob_mask_t aMask);
+static void OOBWriteGMCP(protocol_t* apProtocol, oob_mask_t aPending, string& aResult);
 
 static void ParseGMCP(dPtr apDescriptor, const char* apData);
-string GMCPMessageMode(string key, string Message);
+static bool GMCPParsePayload(string_view aPayload, gmcp_sax_t& aHandler);
+static void GMCPBuildHash(void);
+static void GMCPCoreHello(dPtr apDescriptor, string_view aPayload);
+static void GMCPCoreSupportsSet(dPtr apDescriptor, string_view aPayload);
+static void GMCPCoreSupportsAdd(dPtr apDescriptor, string_view aPayload);
+static void GMCPCoreSupportsRemove(dPtr apDescriptor, string_view aPayload);
+static void GMCPDiscordHello(dPtr apDescriptor, string_view aPayload);
+static void GMCPDiscordGet(dPtr apDescriptor, string_view aPayload);
+static void JSONAppendString(string& aResult, string_view aValue);
+static void GMCPModuleInit(void);
+static gmcp_module_t GMCPModuleLookup(string_view aName);
+static string GMCPModuleKey(string_view aName);
+static void GMCPSetSupport(protocol_t* apProtocol, string_view aModule, bool abSupported);
 
 void SendGMCP(dPtr apDescriptor, const char* apVariable, const char* apValue);
 
 static void SendMSSP(dPtr apDescriptor);
-
+static const gmcp_payload_t& MSSPPayload(bool abPlainText);
+static bool MSSPProbeParse(mssp_probe_t& aProbe, bool abAnywhere);
+static void MSSPProbeWrite(mssp_probe_t& aProbe);
+
+static void SnapshotPutInt(string& aSnapshot, int32_t aValue);
+static void SnapshotPutString(string& aSnapshot, string_view aValue);
+static bool SnapshotGetInt(string_view& aSnapshot, int32_t& aValue);
+static bool SnapshotGetString(string_view& aSnapshot, string& aValue);
+static int SnapshotRead(FILE* apFile, int32_t& aSocket, string& aBody);
+static bool SnapshotRestore(dPtr apDescriptor, string_view aBody);
+
+static const char* FindTelnetOrEscape(const char* apStart, const char* apEnd);
+static void ParseMXP(dPtr apDescriptor, const char* apData);
 static char* GetMxpTag(const char* apTag, const char* apText);
 
+static void ColourInit(void);
+static colour_mode_t GetColourMode(dPtr apDescriptor);
+static const char* GetColour(colour_mode_t aMode, int aColour);
+static int ColourIndex(const char* apRGB);
 static const char* GetAnsiColour(bool abBackground, int aRed, int aGreen, int aBlue);
 static const char* GetRGBColour(bool abBackground, int aRed, int aGreen, int aBlue);
-static bool IsValidColour(const char* apArgument);
 
 static bool MatchString(const char* apFirst, const char* apSecond);
-static bool PrefixString(const char* apPart, const char* apWhole);
+static bool MatchString(string_view aFirst, const char* apSecond);
+static bool PrefixString(const char* apPart, string_view aWhole);
+static char CharAt(string_view aData, size_t aIndex);
 static bool IsNumber(const char* apString);
 static char* AllocString(const char* apString);
+static uint32_t HashName(string_view aName, uint32_t aSeed);
+static uint32_t PerfectHash(const vector<const char*>& aNames, vector<int>& aSlots);
+
+/******************************************************************************
+ GMCP file-scope variables.
+ ******************************************************************************/
+
+typedef struct
+{
+  const char* pName;      /* The package name, such as Core.Hello */
+  gmcp_handler_t Handler; /* Called whenever the client sends it */
+} gmcp_package_t;
+
+/* The packages we respond to, plus any added with GMCPRegister().  Anything
+ * else is ignored without being parsed.
+ */
+static vector<gmcp_package_t> s_GMCPPackages = {
+    {"Core.Hello", GMCPCoreHello},
+    {"Core.Supports.Set", GMCPCoreSupportsSet},
+    {"Core.Supports.Add", GMCPCoreSupportsAdd},
+    {"Core.Supports.Remove", GMCPCoreSupportsRemove},
+    {"External.Discord.Hello", GMCPDiscordHello},
+    {"External.Discord.Get", GMCPDiscordGet},
+};
+
+/* A perfect hash of the package names: each slot holds an index into
+ * s_GMCPPackages, or -1.  The size is always a power of two.
+ */
+static vector<int> s_GMCPSlots;
+static uint32_t s_GMCPSeed = 0;
+
+/* The same for s_GMCPModuleNames, holding a gmcp_module_t or -1 */
+static vector<int> s_GMCPModuleSlots;
+static uint32_t s_GMCPModuleSeed = 0;
 
 /******************************************************************************
  ANSI colour codes.
@@ -361,6 +671,54 @@ static const char s_BackMagenta[] = "\033[1;45m"; /* Magenta background */
 static const char s_BackCyan[] = "\033[1;46m";    /* Cyan background */
 static const char s_BackWhite[] = "\033[1;47m";   /* White background */
 
+/******************************************************************************
+ Colour lookup tables.
+ ******************************************************************************/
+
+/* Every RGB colour is numbered 0-215 for the foreground and 216-431 for the
+ * background, and both the XTerm and ANSI versions are worked out once by
+ * ColourInit(), so substituting a colour code is just a table lookup.
+ */
+#define NO_COLOUR -1
+#define MAX_RGB_COLOURS (6 * 6 * 6 * 2)
+
+static char s_XTermColours[MAX_RGB_COLOURS][16];
+static const char* s_AnsiColours[MAX_RGB_COLOURS];
+
+/* The predefined colour codes for ProtocolOutput().  Add more here. */
+static const struct
+{
+  char Code;        /* The letter following the tab */
+  const char* pRGB; /* The colour it represents, as used by ColourRGB */
+} s_ColourCodeTable[] = {
+    {'d', "F000"}, /* dark grey / black */
+    {'D', "F111"}, /* light grey */
+    {'a', "F021"}, /* dark azure */
+    {'A', "F053"}, /* light Azure */
+    {'r', "F200"}, /* dark red */
+    {'R', "F500"}, /* light red */
+    {'g', "F020"}, /* dark green */
+    {'G', "F050"}, /* light green */
+    {'y', "F330"}, /* dark yellow */
+    {'Y', "F550"}, /* light yellow */
+    {'b', "F012"}, /* dark blue */
+    {'B', "F025"}, /* light blue */
+    {'m', "F202"}, /* dark magenta */
+    {'M', "F505"}, /* light magenta */
+    {'c', "F022"}, /* dark cyan */
+    {'C', "F055"}, /* light cyan */
+    {'w', "F333"}, /* dark white */
+    {'W', "F555"}, /* light white */
+    {'o', "F520"}, /* dark orange */
+    {'O', "F530"}, /* light orange */
+    {'p', "F301"}, /* dark pink */
+    {'P', "F501"}, /* light pink */
+    {'\0', NULL}    /* This must always be last. */
+};
+
+/* The colour number for each code letter, or NO_COLOUR */
+static short s_ColourCodes[256];
+
 /******************************************************************************
  Protocol global functions.
  ******************************************************************************/
@@ -380,11 +738,16 @@ protocol_t* ProtocolCreate(void)
         break;
       }
     }
+    ColourInit();
+    OOBInit();
+    GMCPModuleInit();
   }
 
   pProtocol = new protocol_t();
   pProtocol->WriteOOB = 0;
-  pProtocol->bIACMode = false;
+  pProtocol->InputState = eINPUT_DATA;
+  pProtocol->SubLength = 0;
+  pProtocol->MXPLength = 0;
   pProtocol->bNegotiated = false;
   pProtocol->bBlockMXP = false;
   pProtocol->bTTYPE = false;
@@ -395,30 +758,37 @@ protocol_t* ProtocolCreate(void)
   pProtocol->bMXP = false;
   pProtocol->bGMCP = false;
   pProtocol->bMCCP = false;
+  pProtocol->bMCCP3 = false;
   pProtocol->b256Support = eUNKNOWN;
   pProtocol->ScreenWidth = 0;
   pProtocol->ScreenHeight = 0;
   pProtocol->pMXPVersion = AllocString("Unknown");
   pProtocol->pLastTTYPE = NULL;
-  pProtocol->pVariables = (OOB_t**)malloc(sizeof(OOB_t*) * eOOB_MAX);
   pProtocol->destroyed = false;
-
+  pProtocol->bQueuedOOB = false;
+  pProtocol->bOptimistic = false;
+  pProtocol->bHeardIAC = false;
+  pProtocol->bFingerprinted = false;
+  pProtocol->bRestored = false;
+  pProtocol->GMCPModules = 0;
+  pProtocol->OutputOffset = 0;
+  pProtocol->pDeflate = NULL;
+  pProtocol->CompressClass = eCOMPRESS_NORMAL;
+  pProtocol->CompressMarkers = 0;
+  pProtocol->DeflatedOffset = 0;
+  pProtocol->pInflate = NULL;
+  pProtocol->SkipUntil = 0;
+  pProtocol->SkipMatched = 0;
+
+  /* The OOB masks and values start out zeroed, so just set the defaults */
   for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-    pProtocol->pVariables[i] = (OOB_t*)malloc(sizeof(OOB_t));
-    pProtocol->pVariables[i]->bReport = false;
-    pProtocol->pVariables[i]->bDirty = false;
-    pProtocol->pVariables[i]->ValueInt = 0;
-    pProtocol->pVariables[i]->pValueString = NULL;
-
     if (VariableNameTable[i].bString) {
       if (VariableNameTable[i].pDefault != NULL)
-        pProtocol->pVariables[i]->pValueString = AllocString(VariableNameTable[i].pDefault);
+        pProtocol->Variables.ValueString[i] = VariableNameTable[i].pDefault;
       else if (VariableNameTable[i].bConfigurable)
-        pProtocol->pVariables[i]->pValueString = AllocString("Unknown");
-      else /* Use an empty string */
-        pProtocol->pVariables[i]->pValueString = AllocString("");
+        pProtocol->Variables.ValueString[i] = "Unknown";
     } else if (VariableNameTable[i].Default != 0) {
-      pProtocol->pVariables[i]->ValueInt = VariableNameTable[i].Default;
+      pProtocol->Variables.ValueInt[i] = VariableNameTable[i].Default;
     }
   }
 
@@ -427,179 +797,212 @@ protocol_t* ProtocolCreate(void)
 
 void ProtocolDestroy(protocol_t* apProtocol)
 {
-  int i; /* Loop counter */
-
   if (!apProtocol || apProtocol->destroyed)
     return;
 
   apProtocol->destroyed = true;
 
-  for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-    if (apProtocol->pVariables[i]->pValueString)
-      free(apProtocol->pVariables[i]->pValueString);
-    free(apProtocol->pVariables[i]);
+  /* Don't leave OOBUpdateAll() holding a dangling descriptor */
+  if (apProtocol->bQueuedOOB) {
+    s_DirtyOOB.erase(remove_if(s_DirtyOOB.begin(), s_DirtyOOB.end(),
+                               [apProtocol](dPtr apDescriptor) { return apDescriptor->pProtocol == apProtocol; }),
+                     s_DirtyOOB.end());
   }
 
-  free(apProtocol->pVariables);
+  if (apProtocol->pDeflate != NULL) {
+    deflateEnd(apProtocol->pDeflate);
+    delete apProtocol->pDeflate;
+  }
+
+  if (apProtocol->pInflate != NULL)
+    InflateEnd(apProtocol);
+
   if (apProtocol->pLastTTYPE) /* Isn't saved over copyover so may still be NULL */
     free(apProtocol->pLastTTYPE);
   free(apProtocol->pMXPVersion);
   delete apProtocol;
 }
 
-ssize_t ProtocolInput(dPtr apDescriptor, char* apData, int aSize, char* apOut)
+/* The telnet parser.  Returns how much of the input it used, which is all of
+ * it unless the client starts MCCP3 part way through, or -1 on overflow.
+ */
+static int ParseInput(dPtr apDescriptor, const char* apData, int aSize, char* apOut, int aOutSize,
+                      ssize_t* apCmdIndex)
 {
-  static char CmdBuf[MAX_PROTOCOL_BUFFER + 1];
-  static char IacBuf[MAX_PROTOCOL_BUFFER + 1];
-  ssize_t CmdIndex = 0;
-  ssize_t IacIndex = 0;
-  ssize_t Index;
-
-  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  ssize_t CmdIndex = *apCmdIndex;
+  int Index;
 
   for (Index = 0; Index < aSize; ++Index) {
-    /* If we'd overflow the buffer, we just ignore the input */
-    if (CmdIndex >= MAX_PROTOCOL_BUFFER || IacIndex >= MAX_PROTOCOL_BUFFER) {
+    const char Letter = apData[Index];
+
+    /* If we'd overflow the buffer, we just ignore the input.  An escape
+     * sequence that turns out not to be MXP can flush up to four bytes.
+     */
+    if (CmdIndex + 4 >= aOutSize || pProtocol->SubLength >= MAX_PROTOCOL_BUFFER) {
       ReportBug("ProtocolInput: Too much incoming data to store in the buffer.\n");
+      pProtocol->InputState = eINPUT_DATA;
+      pProtocol->SubLength = 0;
+      apOut[0] = '\0';
       return (-1);
     }
 
-    /* IAC IAC is treated as a single value of 255 */
-    if (apData[Index] == (char)IAC && apData[Index + 1] == (char)IAC) {
-      if (pProtocol->bIACMode)
-        IacBuf[IacIndex++] = (char)IAC;
-      else /* In-band command */
-        CmdBuf[CmdIndex++] = (char)IAC;
-      Index++;
-    } else if (pProtocol->bIACMode) {
-      /* End subnegotiation. */
-      if (apData[Index] == (char)IAC && apData[Index + 1] == (char)SE) {
-        Index++;
-        pProtocol->bIACMode = false;
-        IacBuf[IacIndex] = '\0';
-        if (IacIndex >= 2)
-          PerformSubnegotiation(apDescriptor, IacBuf[0], &IacBuf[1], IacIndex - 1);
-        IacIndex = 0;
-      } else
-        IacBuf[IacIndex++] = apData[Index];
-    } else if (apData[Index] == (char)27 && apData[Index + 1] == '[' && isdigit(apData[Index + 2])
-               && apData[Index + 3] == 'z') {
-      char MXPBuffer[1024];
-      char* pMXPTag = NULL;
-      int i = 0; /* Loop counter */
+    switch (pProtocol->InputState) {
+    case eINPUT_DATA:
+      if (Letter == (char)IAC)
+        pProtocol->InputState = eINPUT_IAC;
+      else if (Letter == (char)27) {
+        pProtocol->MXPBuffer[0] = Letter;
+        pProtocol->MXPLength = 1;
+        pProtocol->InputState = eINPUT_ESC;
+      } else /* In-band command - copy everything up to the next IAC or ESC */
+      {
+        int Length;
 
-      Index += 4; /* Skip to the start of the MXP sequence. */
+        if (pProtocol->bOptimistic && !pProtocol->bHeardIAC)
+          NegotiateFallback(pProtocol);
 
-      while (Index < aSize && apData[Index] != '>' && i < 1000) {
-        MXPBuffer[i++] = apData[Index++];
-      }
-      MXPBuffer[i++] = '>';
-      MXPBuffer[i] = '\0';
+        Length = FindTelnetOrEscape(&apData[Index], &apData[aSize]) - &apData[Index];
 
-      if ((pMXPTag = GetMxpTag("SUPPORTS", MXPBuffer)) != NULL) {
-        InfoMessage(apDescriptor, "MXP SUPPORTS: ");
-        Write(apDescriptor, MXPBuffer);
-        Write(apDescriptor, "\r\n");
-      }
+        /* Copy what fits, the next time round will report the overflow */
+        if (Length > aOutSize - 4 - CmdIndex)
+          Length = aOutSize - 4 - CmdIndex;
 
-      if ((pMXPTag = GetMxpTag("CLIENT=", MXPBuffer)) != NULL) {
-        /* Overwrite the previous client name - this is harder to fake */
-        free(pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString);
-        pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString = AllocString(pMXPTag);
+        memcpy(&apOut[CmdIndex], &apData[Index], Length);
+        CmdIndex += Length;
+        Index += Length - 1;
       }
+      break;
 
-      if ((pMXPTag = GetMxpTag("VERSION=", MXPBuffer)) != NULL) {
-        const char* pClientName = pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString;
+    case eINPUT_IAC:
+      pProtocol->InputState = eINPUT_DATA;
+      pProtocol->bHeardIAC = true;
+      switch (Letter) {
+      case (char)IAC: /* Two IACs count as one. */
+        apOut[CmdIndex++] = (char)IAC;
+        break;
 
-        // InfoMessage(apDescriptor, "Received MXP Version From Client: ");
-        // Write(apDescriptor, pMXPTag);
-        // Write(apDescriptor, "\r\n");
-        // MXPSendTag( apDescriptor, "<SUPPORT>" );
+      case (char)SB: /* Begin subnegotiation. */
+        pProtocol->SubLength = 0;
+        pProtocol->InputState = eINPUT_SB;
+        break;
 
-        free(pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString);
-        pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString = AllocString(pMXPTag);
+      case (char)DO: /* Handshake - the option may be in the next read. */
+      case (char)DONT:
+      case (char)WILL:
+      case (char)WONT:
+        pProtocol->InputCommand = Letter;
+        pProtocol->InputState = eINPUT_COMMAND;
+        break;
 
-        if (MatchString("MUSHCLIENT", pClientName)) {
-          /* MUSHclient 4.02 and later supports 256 colours. */
-          if (strcmp(pMXPTag, "4.02") >= 0) {
-            pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
-            pProtocol->b256Support = eYES;
-          } else /* We know for sure that 256 colours are not supported */
-            pProtocol->b256Support = eNO;
-        } else if (MatchString("CMUD", pClientName)) {
-          /* CMUD 3.04 and later supports 256 colours. */
-          if (strcmp(pMXPTag, "3.04") >= 0) {
-            pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
-            pProtocol->b256Support = eYES;
-          } else /* We know for sure that 256 colours are not supported */
-            pProtocol->b256Support = eNO;
-        } else if (MatchString("ATLANTIS", pClientName)) {
-          /* Atlantis 0.9.9.0 supports XTerm 256 colours, but it doesn't
-           * yet have MXP.  However MXP is planned, so once it responds
-           * to a <VERSION> tag we'll know we can use 256 colours.
-           */
-          pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
-          pProtocol->b256Support = eYES;
-        }
+      default: /* Skip it. */
+        break;
       }
+      break;
+
+    case eINPUT_COMMAND:
+      pProtocol->InputState = eINPUT_DATA;
+      PerformHandshake(apDescriptor, pProtocol->InputCommand, Letter);
+      break;
+
+    case eINPUT_SB:
+      if (Letter == (char)IAC)
+        pProtocol->InputState = eINPUT_SB_IAC;
+      else
+        pProtocol->SubBuffer[pProtocol->SubLength++] = Letter;
+      break;
 
-      if ((pMXPTag = GetMxpTag("MXP=", MXPBuffer)) != NULL) {
-        free(pProtocol->pMXPVersion);
-        pProtocol->pMXPVersion = AllocString(pMXPTag);
+    case eINPUT_SB_IAC:
+      if (Letter == (char)SE) {
+        /* End subnegotiation. */
+        pProtocol->InputState = eINPUT_DATA;
+        pProtocol->SubBuffer[pProtocol->SubLength] = '\0';
+        if (pProtocol->SubLength >= 2)
+          PerformSubnegotiation(apDescriptor, pProtocol->SubBuffer[0], &pProtocol->SubBuffer[1],
+                                pProtocol->SubLength - 1);
+        else if (pProtocol->SubLength == 1 && pProtocol->SubBuffer[0] == (char)TELOPT_MCCP3 &&
+                 InflateStart(apDescriptor)) {
+          /* The rest is compressed, so hand it back to be inflated */
+          pProtocol->SubLength = 0;
+          *apCmdIndex = CmdIndex;
+          return (Index + 1);
+        }
+        pProtocol->SubLength = 0;
+      } else /* IAC IAC is treated as a single value of 255 */
+      {
+        pProtocol->InputState = eINPUT_SB;
+        pProtocol->SubBuffer[pProtocol->SubLength++] = Letter;
       }
+      break;
 
-      /* No longer necessary
-       *
-      if ( strcmp(pProtocol->pMXPVersion, "Unknown") )
+    case eINPUT_ESC:
+      /* MXP replies start with ESC [ <digit> z, anything else is in-band. */
+      pProtocol->MXPBuffer[pProtocol->MXPLength++] = Letter;
+      if ((pProtocol->MXPLength == 2 && Letter == '[') || (pProtocol->MXPLength == 3 && isdigit((unsigned char)Letter)))
+        break;
+
+      if (pProtocol->MXPLength == 4 && Letter == 'z') {
+        pProtocol->MXPLength = 0;
+        pProtocol->InputState = eINPUT_MXP;
+      } else /* Not MXP after all, so pass it on and look at this byte again */
       {
-         Write( apDescriptor, "\n" );
-         sprintf( MXPBuffer, "MXP version %s detected and enabled.\r\n",
-            pProtocol->pMXPVersion );
-         InfoMessage( apDescriptor, MXPBuffer );
-      } */
-    } else /* In-band command */
-    {
-      if (apData[Index] == (char)IAC) {
-        switch (apData[Index + 1]) {
-        case (char)SB: /* Begin subnegotiation. */
-          Index++;
-          pProtocol->bIACMode = true;
-          break;
-
-        case (char)DO: /* Handshake. */
-        case (char)DONT:
-        case (char)WILL:
-        case (char)WONT:
-          PerformHandshake(apDescriptor, apData[Index + 1], apData[Index + 2]);
-          Index += 2;
-          break;
-
-        case (char)IAC: /* Two IACs count as one. */
-          CmdBuf[CmdIndex++] = (char)IAC;
-          Index++;
-          break;
-
-        default: /* Skip it. */
-          Index++;
-          break;
-        }
+        int i; /* Loop counter */
+        for (i = 0; i < pProtocol->MXPLength - 1; ++i)
+          apOut[CmdIndex++] = pProtocol->MXPBuffer[i];
+        pProtocol->MXPLength = 0;
+        pProtocol->InputState = eINPUT_DATA;
+        --Index;
+      }
+      break;
+
+    case eINPUT_MXP:
+      if (Letter == '>' || pProtocol->MXPLength >= MAX_MXP_BUFFER - 2) {
+        pProtocol->MXPBuffer[pProtocol->MXPLength++] = '>';
+        pProtocol->MXPBuffer[pProtocol->MXPLength] = '\0';
+        pProtocol->MXPLength = 0;
+        pProtocol->InputState = eINPUT_DATA;
+        ParseMXP(apDescriptor, pProtocol->MXPBuffer);
       } else
-        CmdBuf[CmdIndex++] = apData[Index];
+        pProtocol->MXPBuffer[pProtocol->MXPLength++] = Letter;
+      break;
     }
   }
 
-  /* Terminate the two buffers */
-  IacBuf[IacIndex] = '\0';
-  CmdBuf[CmdIndex] = '\0';
+  *apCmdIndex = CmdIndex;
+  return (aSize);
+}
+
+ssize_t ProtocolInput(dPtr apDescriptor, const char* apData, int aSize, char* apOut, int aOutSize)
+{
+  ssize_t CmdIndex = 0;
+  int Index = 0;
+
+  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+  if (pProtocol == NULL || apOut == NULL || aOutSize <= 0)
+    return (-1);
+
+  while (Index < aSize) {
+    int Used;
+
+    if (pProtocol->SkipUntil != 0)
+      Used = SkipInput(apDescriptor, &apData[Index], aSize - Index);
+    else if (pProtocol->pInflate == NULL)
+      Used = ParseInput(apDescriptor, &apData[Index], aSize - Index, apOut, aOutSize, &CmdIndex);
+    else /* MCCP3 - inflate it first */
+      Used = InflateInput(apDescriptor, &apData[Index], aSize - Index, apOut, aOutSize, &CmdIndex);
+
+    if (Used < 0)
+      return (-1);
+    Index += Used;
+  }
 
-  /* Copy the input buffer back to the player. */
-  strcat(apOut, CmdBuf);
+  /* Terminate the in-band data */
+  apOut[CmdIndex] = '\0';
   return (CmdIndex);
 }
 
-const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
+void ProtocolOutput(dPtr apDescriptor, string_view aData, string& aResult)
 {
-  static char Result[MAX_OUTPUT_BUFFER + 1];
   const char Tab[] = "\t";
   const char MSP[] = "!!";
   const char MXPStart[] = "\033[1z<";
@@ -612,21 +1015,51 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
 
   bool bTerminate = false, bUseMXP = false, bUseMSP = false;
 
-  int i = 0, j = 0; /* Index values */
+  size_t j = 0; /* Index value */
 
   protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
-  if (pProtocol == NULL || apData == NULL)
-    return apData;
+  if (pProtocol == NULL) {
+    aResult.append(aData);
+    return;
+  }
+
+  /* The result is usually about the same size as the original */
+  const size_t ResultStart = aResult.length();
+  aResult.reserve(ResultStart + aData.length() + aData.length() / 4);
+
+  /* Work out how to render colours once, rather than for every code */
+  const colour_mode_t ColourMode = GetColourMode(apDescriptor);
 
   /* Strip !!SOUND() triggers if they support MSP or are using sound */
-  if (pProtocol->bMSP || pProtocol->pVariables[eOOB_SOUND]->ValueInt)
+  if (pProtocol->bMSP || pProtocol->Variables.ValueInt[eOOB_SOUND])
     bUseMSP = true;
 
-  for (; i < MAX_OUTPUT_BUFFER && apData[j] != '\0' && !bTerminate && (*apLength <= 0 || j < *apLength); ++j) {
-    if (apData[j] == '\t') {
+  /* The same text is often sent to lots of users with the same settings,
+   * so longer strings are rendered once and reused from the cache.
+   */
+  unsigned int Caps = 0;
+  size_t Key = 0;
+  const unsigned int ReportedBugs = s_ReportedBugs;
+
+  if (aData.length() >= MIN_OUTPUT_CACHE_LENGTH) {
+    Caps = OutputCacheCaps(pProtocol, ColourMode, bUseMSP);
+    Key = OutputCacheKey(aData, Caps, pProtocol->pMXPVersion);
+
+    lock_guard<mutex> Lock(s_OutputCacheMutex);
+    output_cache_t* pCached = OutputCacheFind(Key, aData, Caps, pProtocol->pMXPVersion);
+
+    if (pCached != NULL) {
+      aResult.append(pCached->Result);
+      pProtocol->bBlockMXP = pCached->bBlockMXPAfter;
+      return;
+    }
+  }
+
+  for (; j < aData.length() && aData[j] != '\0' && !bTerminate; ++j) {
+    if (CharAt(aData, j) == '\t') {
       const char* pCopyFrom = NULL;
 
-      switch (apData[++j]) {
+      switch (CharAt(aData, ++j)) {
       case '\t': /* Two tabs in a row will display an actual tab */
         pCopyFrom = Tab;
         break;
@@ -651,153 +1084,83 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
       /* 1,2,3 to be used a MUD's base colour palette. Just to maintain
        * some sort of common colouring scheme amongst coders/builders */
       case '1':
-        pCopyFrom = ColourRGB(apDescriptor, RGBone);
+        pCopyFrom = GetColour(ColourMode, ColourIndex(RGBone));
         break;
       case '2':
-        pCopyFrom = ColourRGB(apDescriptor, RGBtwo);
+        pCopyFrom = GetColour(ColourMode, ColourIndex(RGBtwo));
         break;
       case '3':
-        pCopyFrom = ColourRGB(apDescriptor, RGBthree);
+        pCopyFrom = GetColour(ColourMode, ColourIndex(RGBthree));
         break;
       case 'n':
         pCopyFrom = s_Clean;
         break;
-      case 'd': /* dark grey / black */
-        pCopyFrom = ColourRGB(apDescriptor, "F000");
-        break;
-      case 'D': /* light grey */
-        pCopyFrom = ColourRGB(apDescriptor, "F111");
-        break;
-      case 'a': /* dark azure */
-        pCopyFrom = ColourRGB(apDescriptor, "F021");
-        break;
-      case 'A': /* light Azure */
-        pCopyFrom = ColourRGB(apDescriptor, "F053");
-        break;
-      case 'r': /* dark red */
-        pCopyFrom = ColourRGB(apDescriptor, "F200");
-        break;
-      case 'R': /* light red */
-        pCopyFrom = ColourRGB(apDescriptor, "F500");
-        break;
-      case 'g': /* dark green */
-        pCopyFrom = ColourRGB(apDescriptor, "F020");
-        break;
-      case 'G': /* light green */
-        pCopyFrom = ColourRGB(apDescriptor, "F050");
-        break;
-      case 'y': /* dark yellow */
-        pCopyFrom = ColourRGB(apDescriptor, "F330");
-        break;
-      case 'Y': /* light yellow */
-        pCopyFrom = ColourRGB(apDescriptor, "F550");
-        break;
-      case 'b': /* dark blue */
-        pCopyFrom = ColourRGB(apDescriptor, "F012");
-        break;
-      case 'B': /* light blue */
-        pCopyFrom = ColourRGB(apDescriptor, "F025");
-        break;
-      case 'm': /* dark magenta */
-        pCopyFrom = ColourRGB(apDescriptor, "F202");
-        break;
-      case 'M': /* light magenta */
-        pCopyFrom = ColourRGB(apDescriptor, "F505");
-        break;
-      case 'c': /* dark cyan */
-        pCopyFrom = ColourRGB(apDescriptor, "F022");
-        break;
-      case 'C': /* light cyan */
-        pCopyFrom = ColourRGB(apDescriptor, "F055");
-        break;
-      case 'w': /* dark white */
-        pCopyFrom = ColourRGB(apDescriptor, "F333");
-        break;
-      case 'W': /* light white */
-        pCopyFrom = ColourRGB(apDescriptor, "F555");
-        break;
-      case 'o': /* dark orange */
-        pCopyFrom = ColourRGB(apDescriptor, "F520");
-        break;
-      case 'O': /* light orange */
-        pCopyFrom = ColourRGB(apDescriptor, "F530");
-        break;
-      case 'p': /* dark pink */
-        pCopyFrom = ColourRGB(apDescriptor, "F301");
-        break;
-      case 'P': /* light pink */
-        pCopyFrom = ColourRGB(apDescriptor, "F501");
-        break;
       case '(': /* MXP link */
-        if (!pProtocol->bBlockMXP && pProtocol->pVariables[eOOB_MXP]->ValueInt)
+        if (!pProtocol->bBlockMXP && pProtocol->Variables.ValueInt[eOOB_MXP])
           pCopyFrom = LinkStart;
         break;
       case ')': /* MXP link */
-        if (!pProtocol->bBlockMXP && pProtocol->pVariables[eOOB_MXP]->ValueInt)
+        if (!pProtocol->bBlockMXP && pProtocol->Variables.ValueInt[eOOB_MXP])
           pCopyFrom = LinkStop;
         pProtocol->bBlockMXP = false;
         break;
       case '~': // MXP Help link
-        if (!pProtocol->bBlockMXP && pProtocol->pVariables[eOOB_MXP]->ValueInt) {
-          char HelpText[MAX_OUTPUT_BUFFER], HelpBuffer[MAX_OUTPUT_BUFFER];
-          char BugString[MAX_OUTPUT_BUFFER];
-          int h = 0;
+        if (!pProtocol->bBlockMXP && pProtocol->Variables.ValueInt[eOOB_MXP]) {
+          string HelpText;
           bool bDone = false;
 
-          while (apData[++j] != '\0') {
-            if (apData[j] == '\t' && apData[j + 1] == '~') {
+          while (CharAt(aData, ++j) != '\0') {
+            if (aData[j] == '\t' && CharAt(aData, j + 1) == '~') {
               j++;
               bDone = true;
               break;
             } else
-              HelpText[h++] = apData[j];
+              HelpText += aData[j];
           }
 
-          HelpText[h] = '\0';
-
           if (!bDone) {
-            sprintf(BugString, "BUG: MXP Help '%s' wasn't terminated with '@~'.\n", HelpText);
+            char BugString[MAX_INPUT_LENGTH];
+            snprintf(BugString, sizeof(BugString), "BUG: MXP Help '%s' wasn't terminated with '@~'.\n",
+                     HelpText.c_str());
             ReportBug(BugString);
-            if (h)
-              pCopyFrom = HelpText;
+            aResult += HelpText;
           } else {
-            sprintf(HelpBuffer, "%s%s%s%s%s", HelpStart, HelpText, HelpStop, HelpText, LinkStop);
-            pCopyFrom = HelpBuffer;
+            aResult.append(HelpStart).append(HelpText).append(HelpStop).append(HelpText).append(LinkStop);
             pProtocol->bBlockMXP = false;
           }
         }
         break;
       case '<':
-        if (!pProtocol->bBlockMXP && pProtocol->pVariables[eOOB_MXP]->ValueInt) {
+        if (!pProtocol->bBlockMXP && pProtocol->Variables.ValueInt[eOOB_MXP]) {
           pCopyFrom = MXPStart;
           bUseMXP = true;
         } else /* No MXP support, so just strip it out */
         {
-          while (apData[j] != '\0' && apData[j] != '>')
+          while (CharAt(aData, j) != '\0' && CharAt(aData, j) != '>')
             ++j;
         }
         pProtocol->bBlockMXP = false;
         break;
       case '[':
-        if (tolower(apData[++j]) == 'u') {
-          char Buffer[8] = {'\0'}, BugString[256];
+        if (tolower(CharAt(aData, ++j)) == 'u') {
+          char Buffer[8] = {'\0'}, BugString[256], Unicode[8];
           int Index = 0;
           int Number = 0;
           bool bDone = false, bValid = true;
 
-          while (isdigit(apData[++j])) {
+          while (isdigit(CharAt(aData, ++j))) {
             Number *= 10;
-            Number += (apData[j]) - '0';
+            Number += (CharAt(aData, j)) - '0';
           }
 
-          if (apData[j] == '/')
+          if (CharAt(aData, j) == '/')
             ++j;
 
-          while (apData[j] != '\0' && !bDone) {
-            if (apData[j] == ']')
+          while (CharAt(aData, j) != '\0' && !bDone) {
+            if (CharAt(aData, j) == ']')
               bDone = true;
             else if (Index < 7)
-              Buffer[Index++] = apData[j++];
+              Buffer[Index++] = CharAt(aData, j++);
             else /* It's too long, so ignore the rest and note the problem */
             {
               j++;
@@ -811,28 +1174,31 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
           } else if (!bValid) {
             sprintf(BugString, "BUG: Unicode substitute '%s' truncated.  Missing ']'?\n", Buffer);
             ReportBug(BugString);
-          } else if (pProtocol->pVariables[eOOB_UTF_8]->ValueInt) {
-            pCopyFrom = UnicodeGet(Number);
+          } else if (pProtocol->Variables.ValueInt[eOOB_UTF_8]) {
+            /* Both buffers end with this block, so they're added here */
+            char* pUnicode = Unicode;
+            UnicodeAdd(&pUnicode, Number);
+            aResult.append(Unicode, pUnicode - Unicode);
           } else /* Display the substitute string */
           {
-            pCopyFrom = Buffer;
+            aResult += Buffer;
           }
 
           /* Terminate if we've reached the end of the string */
           bTerminate = !bDone;
-        } else if (tolower(apData[j]) == 'f' || tolower(apData[j]) == 'b') {
+        } else if (tolower(CharAt(aData, j)) == 'f' || tolower(CharAt(aData, j)) == 'b') {
           char Buffer[8] = {'\0'}, BugString[256];
           int Index = 0;
           bool bDone = false, bValid = true;
 
           /* Copy the 'f' (foreground) or 'b' (background) */
-          Buffer[Index++] = apData[j++];
+          Buffer[Index++] = CharAt(aData, j++);
 
-          while (apData[j] != '\0' && !bDone && bValid) {
-            if (apData[j] == ']')
+          while (CharAt(aData, j) != '\0' && !bDone && bValid) {
+            if (CharAt(aData, j) == ']')
               bDone = true;
             else if (Index < 4)
-              Buffer[Index++] = apData[j++];
+              Buffer[Index++] = CharAt(aData, j++);
             else /* It's too long, so drop out - the colour code may still be
                     valid */
               bValid = false;
@@ -842,7 +1208,7 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
             sprintf(BugString, "BUG: RGB %sground colour '%s' wasn't terminated with ']'.\n",
                     (tolower(Buffer[0]) == 'f') ? "fore" : "back", &Buffer[1]);
             ReportBug(BugString);
-          } else if (!IsValidColour(Buffer)) {
+          } else if (ColourIndex(Buffer) == NO_COLOUR) {
             sprintf(BugString,
                     "BUG: RGB %sground colour '%s' invalid (each digit must be "
                     "in the range 0-5).\n",
@@ -850,20 +1216,20 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
             ReportBug(BugString);
           } else /* Success */
           {
-            pCopyFrom = ColourRGB(apDescriptor, Buffer);
+            pCopyFrom = GetColour(ColourMode, ColourIndex(Buffer));
           }
-        } else if (tolower(apData[j]) == 'x') {
+        } else if (tolower(CharAt(aData, j)) == 'x') {
           char Buffer[8] = {'\0'}, BugString[256];
           int Index = 0;
           bool bDone = false, bValid = true;
 
           ++j; /* Skip the 'x' */
 
-          while (apData[j] != '\0' && !bDone) {
-            if (apData[j] == ']')
+          while (CharAt(aData, j) != '\0' && !bDone) {
+            if (CharAt(aData, j) == ']')
               bDone = true;
             else if (Index < 7)
-              Buffer[Index++] = apData[j++];
+              Buffer[Index++] = CharAt(aData, j++);
             else /* It's too long, so ignore the rest and note the problem */
             {
               j++;
@@ -895,29 +1261,28 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
       case '\0':
         bTerminate = true;
         break;
-      default:
+      default: /* The predefined colours, see s_ColourCodeTable */
+        if (s_ColourCodes[(unsigned char)CharAt(aData, j)] != NO_COLOUR)
+          pCopyFrom = GetColour(ColourMode, s_ColourCodes[(unsigned char)CharAt(aData, j)]);
         break;
       }
 
       /* Copy the colour code, if any. */
       if (pCopyFrom != NULL) {
-        while (*pCopyFrom != '\0' && i < MAX_OUTPUT_BUFFER)
-          Result[i++] = *pCopyFrom++;
+        aResult += pCopyFrom;
       }
-    } else if (bUseMXP && apData[j] == '>') {
-      const char* pCopyFrom = MXPStop;
-      while (*pCopyFrom != '\0' && i < MAX_OUTPUT_BUFFER)
-        Result[i++] = *pCopyFrom++;
+    } else if (bUseMXP && CharAt(aData, j) == '>') {
+      aResult += MXPStop;
       bUseMXP = false;
-    } else if (bUseMSP && j > 0 && apData[j - 1] == '!' && apData[j] == '!' && PrefixString("SOUND(", &apData[j + 1])) {
+    } else if (bUseMSP && j > 0 && CharAt(aData, j - 1) == '!' && CharAt(aData, j) == '!' && PrefixString("SOUND(", aData.substr(j + 1))) {
       /* Avoid accidental triggering of old-style MSP triggers */
-      Result[i++] = '?';
-    } else if (apData[j] == '&') {
+      aResult += '?';
+    } else if (CharAt(aData, j) == '&') {
       /* Legacy World of Pain color support */
 
       const char* pCopyFrom = NULL;
 
-      switch (apData[++j]) {
+      switch (CharAt(aData, ++j)) {
       case '0':           /* Removed the color check code's here to */
         pCopyFrom = KNRM; /* speed up the exchange JB */
         break;
@@ -988,30 +1353,62 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
       }
       /* Copy the color code, if any. */
       if (pCopyFrom != NULL) {
-        while (*pCopyFrom != '\0' && i < MAX_OUTPUT_BUFFER)
-          Result[i++] = *pCopyFrom++;
+        aResult += pCopyFrom;
       }
     } else /* Just copy the character normally */
     {
-      Result[i++] = apData[j];
+      aResult += CharAt(aData, j);
     }
   }
 
-  /* If we'd overflow the buffer, we don't send any output */
-  if (i >= MAX_OUTPUT_BUFFER) {
-    i = 0;
-    ReportBug("ProtocolOutput: Too much outgoing data to store in the buffer.\n");
+  /* Anything with a bug report is left out, so the report is seen every time */
+  if (aData.length() >= MIN_OUTPUT_CACHE_LENGTH && s_ReportedBugs == ReportedBugs) {
+    lock_guard<mutex> Lock(s_OutputCacheMutex);
+    OutputCacheAdd(Key, aData, Caps, pProtocol->pMXPVersion, string_view(aResult).substr(ResultStart),
+                   pProtocol->bBlockMXP);
   }
+}
 
-  /* Terminate the string */
-  Result[i] = '\0';
+const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
+{
+  thread_local string Result;
+
+  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+  if (pProtocol == NULL || apData == NULL)
+    return apData;
+
+  Result.clear();
+  ProtocolOutput(apDescriptor,
+                 string_view(apData, (apLength && *apLength > 0) ? strnlen(apData, *apLength) : strlen(apData)),
+                 Result);
 
   /* Store the length */
   if (apLength)
-    *apLength = i;
+    *apLength = Result.length();
 
   /* Return the string */
-  return Result;
+  return Result.c_str();
+}
+
+void ProtocolOutputInvalidate(const char* apData)
+{
+  lock_guard<mutex> Lock(s_OutputCacheMutex);
+
+  if (apData == NULL) {
+    s_OutputCacheIndex.clear();
+    s_OutputCache.clear();
+    return;
+  }
+
+  auto Iter = s_OutputCache.begin();
+
+  while (Iter != s_OutputCache.end()) {
+    if (Iter->Source == apData) {
+      s_OutputCacheIndex.erase(Iter->Key);
+      Iter = s_OutputCache.erase(Iter);
+    } else
+      ++Iter;
+  }
 }
 
 /* Some clients (such as GMud) don't properly handle negotiation, and simply
@@ -1019,52 +1416,204 @@ const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength)
  * printable character, so we negotiate for it first, and only negotiate for
  * other protocols if the client responds with IAC WILL TTYPE or IAC WONT
  * TTYPE.  Thanks go to Donky on MudBytes for the suggestion.
+ *
+ * That costs a round trip before anything else can be offered, though, so
+ * OPTIMISTIC_NEGOTIATION offers the lot straight away, and falls back to the
+ * careful way for hosts where that turned out to be a mistake.
  */
 void ProtocolNegotiate(dPtr apDescriptor)
 {
   static const char DoTTYPE[] = {(char)IAC, (char)DO, TELOPT_TTYPE, '\0'};
-  Write(apDescriptor, DoTTYPE);
-}
+  protocol_t* pProtocol = apDescriptor->pProtocol;
 
-/******************************************************************************
- Copyover save/load functions.
- ******************************************************************************/
+  Queue(apDescriptor, DoTTYPE);
+  pProtocol->Host = apDescriptor->host;
 
-const char* CopyoverGet(dPtr apDescriptor)
+#ifdef OPTIMISTIC_NEGOTIATION
+  if (!pProtocol->bNegotiated && s_PlainHosts.count(pProtocol->Host) == 0) {
+    pProtocol->bNegotiated = true;
+    pProtocol->bOptimistic = true;
+    Negotiate(apDescriptor);
+  }
+#endif // OPTIMISTIC_NEGOTIATION
+}
+
+ssize_t ProtocolFlush(dPtr apDescriptor, string_view aText)
 {
-  static char Buffer[64];
-  char* pBuffer = Buffer;
   protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+  ssize_t Total = 0;
+  size_t TextSent = 0;
+  bool bCorked = false;
+  bool bBlocked = false;
 
-  if (pProtocol != NULL) {
-    sprintf(Buffer, "%d/%d", pProtocol->ScreenWidth, pProtocol->ScreenHeight);
+  if (pProtocol == NULL)
+    return (-1);
 
-    /* Skip to the end */
-    while (*pBuffer != '\0')
-      ++pBuffer;
+  /* MCCP needs everything in order through one stream, so it's sent from its
+   * own buffer - including any plain output left over from before it ended.
+   */
+  if (pProtocol->pDeflate != NULL || pProtocol->CompressMarkers > 0 || !pProtocol->Deflated.empty())
+    return FlushDeflated(apDescriptor, aText);
 
-    if (pProtocol->bTTYPE)
-      *pBuffer++ = 'T';
-    if (pProtocol->bNAWS)
-      *pBuffer++ = 'N';
-    if (pProtocol->bMSDP)
-      *pBuffer++ = 'M';
-    if (pProtocol->bMSP)
-      *pBuffer++ = 'S';
-    if (pProtocol->pVariables[eOOB_MXP]->ValueInt)
-      *pBuffer++ = 'X';
-    if (pProtocol->bGMCP)
-      *pBuffer++ = 'G';
+  deque<output_chunk_t>& OutputQueue = pProtocol->OutputQueue;
+  size_t Pieces = OutputQueue.size() + (aText.empty() ? 0 : 1);
+
+  if (Pieces == 0)
+    return 0;
+
+  ++s_FlushStats.Flushes;
+
+  /* Hold back partial packets until it's all gone, then uncorking pushes
+   * out the last one straight away, whatever Nagle thinks.
+   */
+  if (Pieces > 1) {
+    bCorked = true;
+    ++s_FlushStats.Corked;
+    SetSocketOption(apDescriptor->descriptor, TCP_CORK, 1);
+  }
+
+  while (!bBlocked && (!OutputQueue.empty() || TextSent < aText.length())) {
+    struct iovec Iov[MAX_OUTPUT_IOV];
+    int Count = 0;
+    bool bText = false;
+    ssize_t Sent;
+
+    for (const output_chunk_t& Chunk : OutputQueue) {
+      const string& Data = Chunk.pShared ? *Chunk.pShared : Chunk.Data;
+      size_t Offset = Count == 0 ? pProtocol->OutputOffset : 0;
+
+      if (Count == MAX_OUTPUT_IOV)
+        break;
+      Iov[Count].iov_base = (void*)(Data.data() + Offset);
+      Iov[Count].iov_len = Data.length() - Offset;
+      ++Count;
+    }
+
+    if (Count < MAX_OUTPUT_IOV && TextSent < aText.length()) {
+      Iov[Count].iov_base = (void*)(aText.data() + TextSent);
+      Iov[Count].iov_len = aText.length() - TextSent;
+      bText = true;
+      ++Count;
+    }
+
+    ++s_FlushStats.Syscalls;
+    Sent = writev(apDescriptor->descriptor, Iov, Count);
+    if (Sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        bBlocked = true;
+        break;
+      }
+      Total = -1;
+      break;
+    }
+
+    Total += Sent;
+
+    /* Drop everything that went, and remember how far into the next it got */
+    for (int i = 0; i < Count - (bText ? 1 : 0); ++i) {
+      if ((size_t)Sent < Iov[i].iov_len) {
+        pProtocol->OutputOffset += Sent;
+        Sent = 0;
+        bBlocked = true;
+        break;
+      }
+      Sent -= Iov[i].iov_len;
+      pProtocol->OutputOffset = 0;
+      OutputQueue.pop_front();
+    }
+
+    if (bText && !bBlocked) {
+      TextSent += Sent;
+      bBlocked = TextSent < aText.length();
+    }
+  }
+
+  if (bCorked)
+    SetSocketOption(apDescriptor->descriptor, TCP_CORK, 0);
+
+  if (Total < 0)
+    return (-1);
+
+  if (bBlocked)
+    ++s_FlushStats.Blocked;
+  s_FlushStats.Bytes += Total;
+
+  /* Keep the rest of the text for the next call, behind the protocol data */
+  if (TextSent < aText.length()) {
+    if (OutputQueue.empty() || OutputQueue.back().pShared || OutputQueue.back().Type != eCHUNK_DATA)
+      OutputQueue.emplace_back();
+    OutputQueue.back().Data.append(aText.substr(TextSent));
+  }
+
+  if (bBlocked && OutputOverflow(apDescriptor))
+    return (-1);
+
+  return Total;
+}
+
+const flush_stats_t& ProtocolFlushStats(void)
+{
+  return s_FlushStats;
+}
+
+/******************************************************************************
+ Copyover save/load functions.
+ ******************************************************************************/
+
+void CopyoverPrepare(void)
+{
+  CompressFinishAll(vector<dPtr>(descriptor_list.begin(), descriptor_list.end()));
+}
+
+const char* CopyoverGet(dPtr apDescriptor)
+{
+  static char Buffer[64];
+  char* pBuffer = Buffer;
+  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+
+  if (pProtocol != NULL) {
+    sprintf(Buffer, "%d/%d", pProtocol->ScreenWidth, pProtocol->ScreenHeight);
+
+    /* Skip to the end */
+    while (*pBuffer != '\0')
+      ++pBuffer;
+
+    if (pProtocol->bTTYPE)
+      *pBuffer++ = 'T';
+    if (pProtocol->bNAWS)
+      *pBuffer++ = 'N';
+    if (pProtocol->bMSDP)
+      *pBuffer++ = 'M';
+    if (pProtocol->bMSP)
+      *pBuffer++ = 'S';
+    if (pProtocol->Variables.ValueInt[eOOB_MXP])
+      *pBuffer++ = 'X';
+    if (pProtocol->bGMCP)
+      *pBuffer++ = 'G';
+    if (pProtocol->bMCCP3) {
+      /* The new process can't pick up the client's stream, so ask it to stop */
+      *pBuffer++ = 'i';
+      Queue(apDescriptor, WONT_MCCP3);
+      ProtocolFlush(apDescriptor);
+    }
     if (pProtocol->bMCCP) {
-      *pBuffer++ = 'c';
+      /* The new process starts a fresh stream, so this one has to be
+       * finished first, which CopyoverPrepare() does for everyone at once.
+       * If the end of it hasn't been sent, the client is still expecting
+       * compressed data, so it mustn't be sent a new start.
+       */
       CompressEnd(apDescriptor);
-      do_log("called CompressEnd from CopyoverGet");
+      ProtocolFlush(apDescriptor);
+      if (CompressFinished(pProtocol))
+        *pBuffer++ = 'c';
+      else
+        ReportBug("MCCP: Couldn't finish the compressed stream before copyover.\n");
     }
-    if (pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt)
+    if (pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS])
       *pBuffer++ = 'C';
     if (pProtocol->bCHARSET)
       *pBuffer++ = 'H';
-    if (pProtocol->pVariables[eOOB_UTF_8]->ValueInt)
+    if (pProtocol->Variables.ValueInt[eOOB_UTF_8])
       *pBuffer++ = 'U';
   }
 
@@ -1099,23 +1648,37 @@ void CopyoverSet(dPtr apDescriptor, const char* apData)
         break;
       case 'X':
         pProtocol->bMXP = true;
-        pProtocol->pVariables[eOOB_MXP]->ValueInt = 1;
+        pProtocol->Variables.ValueInt[eOOB_MXP] = 1;
         break;
       case 'G':
         pProtocol->bGMCP = true;
+        OOBMarkDirty(apDescriptor, 0);
         break;
       case 'c':
         pProtocol->bMCCP = true;
         CompressStart(apDescriptor);
         break;
+      case 'i': /* MCCP3 was turned off for the copyover, so offer it again */
+      {
+        /* The client only ends its stream when it reads the WONT, so the
+         * last of it arrives here.  Drop everything up to its answer to the
+         * TIMING-MARK, which it sends after that, then start afresh.
+         */
+        const char DoTimingMark[] = {(char)IAC, (char)DO, TELOPT_TM, '\0'};
+        const char WillMCCP3[] = {(char)IAC, (char)WILL, TELOPT_MCCP3, '\0'};
+        pProtocol->SkipUntil = time(0) + MCCP3_SKIP_WAIT;
+        pProtocol->SkipMatched = 0;
+        Queue(apDescriptor, DoTimingMark);
+        Queue(apDescriptor, WillMCCP3);
+      } break;
       case 'C':
-        pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
+        pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
         break;
       case 'H':
         pProtocol->bCHARSET = true;
         break;
       case 'U':
-        pProtocol->pVariables[eOOB_UTF_8]->ValueInt = 1;
+        pProtocol->Variables.ValueInt[eOOB_UTF_8] = 1;
         break;
       default:
         if (apData[i] == '/')
@@ -1141,12 +1704,14 @@ void CopyoverSet(dPtr apDescriptor, const char* apData)
     /* GMCP > MSDP
      */
 
-    if (pProtocol->bGMCP) {
+    if (pProtocol->bRestored) {
+      /* The client still has it on, and we know everything it told us */
+    } else if (pProtocol->bGMCP) {
       char WillGMCP[] = {(char)IAC, (char)WILL, (char)TELOPT_GMCP, '\0'};
-      Write(apDescriptor, WillGMCP);
+      Queue(apDescriptor, WillGMCP);
     } else if (pProtocol->bMSDP) {
       char WillMSDP[] = {(char)IAC, (char)WILL, (char)TELOPT_MSDP, '\0'};
-      Write(apDescriptor, WillMSDP);
+      Queue(apDescriptor, WillMSDP);
     }
 
     /* Ask the client to send its MXP version again */
@@ -1157,41 +1722,156 @@ void CopyoverSet(dPtr apDescriptor, const char* apData)
   }
 }
 
+/* A snapshot is a record for each player: "PSNP", the layout version, the
+ * socket and the length of the rest, which is a list of ints and strings.
+ */
+bool CopyoverSave(dPtr apDescriptor, FILE* apFile)
+{
+  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+  string Snapshot = "PSNP";
+  size_t BodyStart;
+  int i; /* Loop counter */
+
+  if (pProtocol == NULL || apFile == NULL)
+    return false;
+
+  SnapshotPutInt(Snapshot, SNAPSHOT_VERSION);
+  SnapshotPutInt(Snapshot, apDescriptor->descriptor);
+  SnapshotPutInt(Snapshot, 0); /* The length, filled in at the end */
+  BodyStart = Snapshot.length();
+
+  SnapshotPutInt(Snapshot, pProtocol->bNegotiated);
+  SnapshotPutInt(Snapshot, pProtocol->bTTYPE);
+  SnapshotPutInt(Snapshot, pProtocol->bNAWS);
+  SnapshotPutInt(Snapshot, pProtocol->bCHARSET);
+  SnapshotPutInt(Snapshot, pProtocol->bMSDP);
+  SnapshotPutInt(Snapshot, pProtocol->bMSP);
+  SnapshotPutInt(Snapshot, pProtocol->bMXP);
+  SnapshotPutInt(Snapshot, pProtocol->bGMCP);
+  SnapshotPutInt(Snapshot, pProtocol->bBlockMXP);
+  SnapshotPutInt(Snapshot, pProtocol->b256Support);
+  SnapshotPutInt(Snapshot, pProtocol->ScreenWidth);
+  SnapshotPutInt(Snapshot, pProtocol->ScreenHeight);
+  SnapshotPutInt(Snapshot, pProtocol->CompressClass);
+  SnapshotPutString(Snapshot, pProtocol->pMXPVersion);
+  SnapshotPutString(Snapshot, pProtocol->Host);
+
+  /* GMCP modules by name, so the list of known ones can change */
+  SnapshotPutInt(Snapshot, __builtin_popcount(pProtocol->GMCPModules) + pProtocol->GMCPSupports.size());
+  for (i = 0; i < eGMCP_MAX; ++i) {
+    if (pProtocol->GMCPModules & GMCP_BIT(i))
+      SnapshotPutString(Snapshot, s_GMCPModuleNames[i]);
+  }
+  for (const string& Module : pProtocol->GMCPSupports)
+    SnapshotPutString(Snapshot, Module);
+
+  /* Variables by name as well, with whether they're reported and pending */
+  SnapshotPutInt(Snapshot, eOOB_MAX - (eOOB_NONE + 1));
+  for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
+    SnapshotPutString(Snapshot, VariableNameTable[i].pName);
+    SnapshotPutInt(Snapshot, (pProtocol->Variables.Report & OOB_BIT(i)) ? 1 : 0);
+    SnapshotPutInt(Snapshot, (pProtocol->Variables.Dirty & OOB_BIT(i)) ? 1 : 0);
+    SnapshotPutInt(Snapshot, VariableNameTable[i].bString);
+    if (VariableNameTable[i].bString)
+      SnapshotPutString(Snapshot, pProtocol->Variables.ValueString[i]);
+    else
+      SnapshotPutInt(Snapshot, pProtocol->Variables.ValueInt[i]);
+  }
+
+  /* Now the length is known, and anything too big to load isn't saved */
+  int32_t Length = Snapshot.length() - BodyStart;
+  if (Length > MAX_SNAPSHOT_RECORD) {
+    ReportBug("CopyoverSave: Snapshot is too big to save.\n");
+    return false;
+  }
+  memcpy(&Snapshot[BodyStart - sizeof(Length)], &Length, sizeof(Length));
+
+  return fwrite(Snapshot.data(), 1, Snapshot.length(), apFile) == Snapshot.length();
+}
+
+bool CopyoverLoad(dPtr apDescriptor, FILE* apFile)
+{
+  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+  int32_t Socket;
+  string Body;
+  long Start;
+  bool bWrapped = false;
+
+  if (pProtocol == NULL || apFile == NULL || (Start = ftell(apFile)) < 0)
+    return false;
+
+  /* They're normally loaded in the order they were saved, so start looking
+   * where the last one left off, and go round once.
+   */
+  for (;;) {
+    int Result = SnapshotRead(apFile, Socket, Body);
+
+    if (Result > 0 && Socket == apDescriptor->descriptor) {
+      char BugString[MAX_INPUT_LENGTH];
+
+      if (Result != SNAPSHOT_VERSION) {
+        snprintf(BugString, sizeof(BugString), "CopyoverLoad: Snapshot is version %d, expected %d.\n", Result,
+                 SNAPSHOT_VERSION);
+        ReportBug(BugString);
+        return false;
+      } else if (!SnapshotRestore(apDescriptor, Body)) {
+        snprintf(BugString, sizeof(BugString), "CopyoverLoad: Snapshot for socket %d is corrupt.\n", (int)Socket);
+        ReportBug(BugString);
+        return false;
+      }
+      return true;
+    } else if (Result <= 0) {
+      if (bWrapped || Start == 0)
+        return false;
+      rewind(apFile);
+      bWrapped = true;
+    } else if (bWrapped && ftell(apFile) > Start) {
+      return false;
+    }
+  }
+}
+
 /******************************************************************************
  MSDP global functions.
  ******************************************************************************/
 
 void OOBUpdate(dPtr apDescriptor)
 {
-  int i;               /* Loop counter */
-  map<string, json> j; // json object map
+  oob_mask_t Pending; /* The variables still to send */
 
   protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+  if (pProtocol == NULL)
+    return;
 
-  for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-    if (pProtocol->pVariables[i]->bReport || pProtocol->bGMCP) {
-      if (pProtocol->pVariables[i]->bDirty) {
-        if (pProtocol->bGMCP) {
-          if (VariableNameTable[i].bString) {
-            j[VariableNameTable[i].pCategory] +=
-                json::object_t::value_type(VariableNameTable[i].pKey, pProtocol->pVariables[i]->pValueString);
-          } else {
-            j[VariableNameTable[i].pCategory] +=
-                json::object_t::value_type(VariableNameTable[i].pKey, pProtocol->pVariables[i]->ValueInt);
-          }
-        } else {
-          OOBSend(apDescriptor, (variable_t)i);
-        }
-        pProtocol->pVariables[i]->bDirty = false;
-      }
+  Pending = OOBPending(pProtocol);
+  pProtocol->Variables.Dirty &= ~Pending;
+
+  if (pProtocol->bGMCP) {
+    if (Pending != 0) {
+      OOBWriteGMCP(pProtocol, Pending, QueueBuffer(apDescriptor));
+    }
+  } else /* Only visit the set bits, lowest (first in the table) first */
+  {
+    while (Pending != 0) {
+      int i = __builtin_ctzll(Pending);
+      Pending &= Pending - 1;
+      OOBSend(apDescriptor, (variable_t)i);
     }
   }
+}
 
-  if (pProtocol->bGMCP && !j.empty()) {
-    for (auto const& [key, val] : j) {
-      SendGMCPJ(apDescriptor, key, val.dump(0));
-    }
+void OOBUpdateAll(void)
+{
+  /* Take the list first, in case an update dirties something again */
+  static vector<dPtr> s_Updating;
+  s_Updating.swap(s_DirtyOOB);
+
+  for (dPtr pDescriptor : s_Updating) {
+    pDescriptor->pProtocol->bQueuedOOB = false;
+    OOBUpdate(pDescriptor);
   }
+
+  s_Updating.clear();
 }
 
 void OOBFlush(dPtr apDescriptor, variable_t aOOB)
@@ -1199,10 +1879,10 @@ void OOBFlush(dPtr apDescriptor, variable_t aOOB)
   if (aOOB > eOOB_NONE && aOOB < eOOB_MAX) {
     protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-    if (pProtocol->pVariables[aOOB]->bReport) {
-      if (pProtocol->pVariables[aOOB]->bDirty) {
+    if (pProtocol->Variables.Report & OOB_BIT(aOOB)) {
+      if (pProtocol->Variables.Dirty & OOB_BIT(aOOB)) {
         OOBSend(apDescriptor, aOOB);
-        pProtocol->pVariables[aOOB]->bDirty = false;
+        pProtocol->Variables.Dirty &= ~OOB_BIT(aOOB);
       }
     }
   }
@@ -1210,122 +1890,68 @@ void OOBFlush(dPtr apDescriptor, variable_t aOOB)
 
 void OOBSend(dPtr apDescriptor, variable_t aOOB)
 {
-  char OOBBuffer[MAX_VARIABLE_LENGTH + 1] = {'\0'};
-
   if (aOOB > eOOB_NONE && aOOB < eOOB_MAX) {
     protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-    if (VariableNameTable[aOOB].bString) {
-      /* Should really be replaced with a dynamic buffer */
-      int RequiredBuffer =
-          strlen(VariableNameTable[aOOB].pName) + strlen(pProtocol->pVariables[aOOB]->pValueString) + 12;
-
-      if (RequiredBuffer >= MAX_VARIABLE_LENGTH) {
-        sprintf(OOBBuffer, "OOBSend: %s %d bytes (exceeds MAX_VARIABLE_LENGTH of %d).\n", VariableNameTable[aOOB].pName,
-                RequiredBuffer, MAX_VARIABLE_LENGTH);
-        ReportBug(OOBBuffer);
-        OOBBuffer[0] = '\0';
-      } else if (pProtocol->bGMCP) {
-        sprintf(OOBBuffer, "%c%c%cGMCP.%s %s%c%c", IAC, SB, TELOPT_GMCP, VariableNameTable[aOOB].pName,
-                pProtocol->pVariables[aOOB]->pValueString, IAC, SE);
-      } else if (pProtocol->bMSDP) {
-        sprintf(OOBBuffer, "%c%c%c%c%s%c%s%c%c", IAC, SB, TELOPT_MSDP, OOB_VAR, VariableNameTable[aOOB].pName, OOB_VAL,
-                pProtocol->pVariables[aOOB]->pValueString, IAC, SE);
-      }
-    } else /* It's an integer, not a string */
+    /* Just in case someone calls this function without checking MSDP/GMCP */
+    if (!pProtocol->bGMCP && !pProtocol->bMSDP)
+      return;
+
+    string& Frame = QueueBuffer(apDescriptor);
+    if (pProtocol->bGMCP) {
+      FrameStart(Frame, (char)TELOPT_GMCP);
+      Frame += "GMCP.";
+      FrameAppend(Frame, VariableNameTable[aOOB].pName);
+      Frame += ' ';
+    } else /* MSDP */
     {
-      if (pProtocol->bGMCP) {
-        sprintf(OOBBuffer, "%c%c%cGMCP.%s %d%c%c", IAC, SB, TELOPT_GMCP, VariableNameTable[aOOB].pName,
-                pProtocol->pVariables[aOOB]->ValueInt, IAC, SE);
-      } else if (pProtocol->bMSDP) {
-        sprintf(OOBBuffer, "%c%c%c%c%s%c%d%c%c", IAC, SB, TELOPT_MSDP, OOB_VAR, VariableNameTable[aOOB].pName, OOB_VAL,
-                pProtocol->pVariables[aOOB]->ValueInt, IAC, SE);
-      }
+      FrameStart(Frame, (char)TELOPT_MSDP);
+      Frame += (char)OOB_VAR;
+      FrameAppend(Frame, VariableNameTable[aOOB].pName);
+      Frame += (char)OOB_VAL;
     }
 
-    /* Just in case someone calls this function without checking MSDP/GMCP */
-    if (OOBBuffer[0] != '\0')
-      Write(apDescriptor, OOBBuffer);
+    if (VariableNameTable[aOOB].bString)
+      FrameAppend(Frame, pProtocol->Variables.ValueString[aOOB]);
+    else /* It's an integer, not a string */
+      FrameAppendNumber(Frame, pProtocol->Variables.ValueInt[aOOB]);
+
+    FrameEnd(Frame);
   }
 }
 
 void OOBSendPair(dPtr apDescriptor, const char* apVariable, const char* apValue)
 {
-  char OOBBuffer[MAX_VARIABLE_LENGTH + 1] = {'\0'};
-
   if (apVariable != NULL && apValue != NULL) {
     protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-    /* Should really be replaced with a dynamic buffer */
-    int RequiredBuffer = strlen(apVariable) + strlen(apValue) + 12;
-
-    if (RequiredBuffer >= MAX_VARIABLE_LENGTH) {
-      if (RequiredBuffer - strlen(apValue) < MAX_VARIABLE_LENGTH) {
-        sprintf(OOBBuffer, "OOBSendPair: %s %d bytes (exceeds MAX_VARIABLE_LENGTH of %d).\n", apVariable,
-                RequiredBuffer, MAX_VARIABLE_LENGTH);
-      } else /* The variable name itself is too long */
-      {
-        sprintf(OOBBuffer,
-                "OOBSendPair: Variable name has a length of %d bytes (exceeds "
-                "MAX_VARIABLE_LENGTH of %d).\n",
-                RequiredBuffer, MAX_VARIABLE_LENGTH);
-      }
-
-      ReportBug(OOBBuffer);
-      OOBBuffer[0] = '\0';
-    } else if (pProtocol->bGMCP) {
-      sprintf(OOBBuffer, "%c%c%cGMCP.%s %s%c%c", IAC, SB, TELOPT_GMCP, apVariable, apValue, IAC, SE);
+    if (pProtocol->bGMCP) {
+      string& Frame = QueueBuffer(apDescriptor);
+      FrameStart(Frame, (char)TELOPT_GMCP);
+      Frame += "GMCP.";
+      FrameAppend(Frame, apVariable);
+      Frame += ' ';
+      FrameAppend(Frame, apValue);
+      FrameEnd(Frame);
     } else if (pProtocol->bMSDP) {
-      sprintf(OOBBuffer, "%c%c%c%c%s%c%s%c%c", IAC, SB, TELOPT_MSDP, OOB_VAR, apVariable, OOB_VAL, apValue, IAC, SE);
+      string& Frame = QueueBuffer(apDescriptor);
+      FrameStart(Frame, (char)TELOPT_MSDP);
+      Frame += (char)OOB_VAR;
+      FrameAppend(Frame, apVariable);
+      Frame += (char)OOB_VAL;
+      FrameAppend(Frame, apValue);
+      FrameEnd(Frame);
     }
-
-    /* Just in case someone calls this function without checking MSDP/GMCP */
-    if (OOBBuffer[0] != '\0')
-      Write(apDescriptor, OOBBuffer);
   }
 }
 
 void OOBSendList(dPtr apDescriptor, const char* apVariable, const char* apValue)
 {
-  char OOBBuffer[MAX_VARIABLE_LENGTH + 1] = {'\0'};
-
   if (apVariable != NULL && apValue != NULL) {
     protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-    /* Should really be replaced with a dynamic buffer */
-    int RequiredBuffer = strlen(apVariable) + strlen(apValue) + 12;
-
-    if (RequiredBuffer >= MAX_VARIABLE_LENGTH) {
-      if (RequiredBuffer - strlen(apValue) < MAX_VARIABLE_LENGTH) {
-        sprintf(OOBBuffer, "OOBSendList: %s %d bytes (exceeds MAX_VARIABLE_LENGTH of %d).\n", apVariable,
-                RequiredBuffer, MAX_VARIABLE_LENGTH);
-      } else /* The variable name itself is too long */
-      {
-        sprintf(OOBBuffer,
-                "OOBSendList: Variable name has a length of %d bytes (exceeds "
-                "MAX_VARIABLE_LENGTH of %d).\n",
-                RequiredBuffer, MAX_VARIABLE_LENGTH);
-      }
-
-      ReportBug(OOBBuffer);
-      OOBBuffer[0] = '\0';
-    } else if (pProtocol->bGMCP) {
-      sprintf(OOBBuffer, "%c%c%cGMCP.%s %s%c%c", IAC, SB, TELOPT_GMCP, apVariable, apValue, IAC, SE);
-    } else if (pProtocol->bMSDP) {
-      int i; /* Loop counter */
-      sprintf(OOBBuffer, "%c%c%c%c%s%c%c%c%s%c%c%c", IAC, SB, TELOPT_MSDP, OOB_VAR, apVariable, OOB_VAL, OOB_ARRAY_OPEN,
-              OOB_VAL, apValue, OOB_ARRAY_CLOSE, IAC, SE);
-
-      /* Convert the spaces to OOB_VAL */
-      for (i = 0; OOBBuffer[i] != '\0'; ++i) {
-        if (OOBBuffer[i] == ' ')
-          OOBBuffer[i] = OOB_VAL;
-      }
-    }
-
-    /* Just in case someone calls this function without checking MSDP/GMCP */
-    if (OOBBuffer[0] != '\0')
-      Write(apDescriptor, OOBBuffer);
+    if (pProtocol->bGMCP || pProtocol->bMSDP)
+      FrameList(QueueBuffer(apDescriptor), pProtocol->bGMCP, apVariable, apValue);
   }
 }
 
@@ -1335,15 +1961,10 @@ void OOBSetNumber(dPtr apDescriptor, variable_t aOOB, int aValue)
 
   if (pProtocol != NULL && aOOB > eOOB_NONE && aOOB < eOOB_MAX) {
     if (!VariableNameTable[aOOB].bString) {
-      if (pProtocol->pVariables[aOOB]->ValueInt != aValue) {
-        pProtocol->pVariables[aOOB]->ValueInt = aValue;
-        pProtocol->pVariables[aOOB]->bDirty = true;
-        if (HAS_GMCP(apDescriptor)) { // make other variables in the category dirty
-          for (int i = eOOB_NONE; i < eOOB_MAX; i++) {
-            if (VariableNameTable[i].pCategory == VariableNameTable[aOOB].pCategory)
-              pProtocol->pVariables[i]->bDirty = true;
-          }
-        }
+      if (pProtocol->Variables.ValueInt[aOOB] != aValue) {
+        pProtocol->Variables.ValueInt[aOOB] = aValue;
+        /* GMCP sends the whole category, so make the rest of it dirty too */
+        OOBMarkDirty(apDescriptor, HAS_GMCP(apDescriptor) ? s_OOBCategoryMask[aOOB] : OOB_BIT(aOOB));
       }
     }
   }
@@ -1355,17 +1976,10 @@ void OOBSetString(dPtr apDescriptor, variable_t aOOB, const char* apValue)
 
   if (pProtocol != NULL && apValue != NULL) {
     if (VariableNameTable[aOOB].bString) {
-      if (pProtocol->pVariables[aOOB]->pValueString && strcmp(pProtocol->pVariables[aOOB]->pValueString, apValue)) {
-        if (pProtocol->pVariables[aOOB]->pValueString)
-          free(pProtocol->pVariables[aOOB]->pValueString);
-        pProtocol->pVariables[aOOB]->pValueString = AllocString(apValue);
-        pProtocol->pVariables[aOOB]->bDirty = true;
-        if (HAS_GMCP(apDescriptor)) { // make other variables in the category dirty
-          for (int i = eOOB_NONE; i < eOOB_MAX; i++) {
-            if (VariableNameTable[i].pCategory == VariableNameTable[aOOB].pCategory)
-              pProtocol->pVariables[i]->bDirty = true;
-          }
-        }
+      if (pProtocol->Variables.ValueString[aOOB] != apValue) {
+        pProtocol->Variables.ValueString[aOOB] = apValue;
+        /* GMCP sends the whole category, so make the rest of it dirty too */
+        OOBMarkDirty(apDescriptor, HAS_GMCP(apDescriptor) ? s_OOBCategoryMask[aOOB] : OOB_BIT(aOOB));
       }
     }
   }
@@ -1380,22 +1994,16 @@ void OOBSetTable(dPtr apDescriptor, variable_t aOOB, const char* apValue)
       /* It's easier to call OOBSetString if the value is empty */
       OOBSetString(apDescriptor, aOOB, apValue);
     } else if (VariableNameTable[aOOB].bString) {
-      const char MsdpTableStart[] = {(char)OOB_TABLE_OPEN, '\0'};
-      const char MsdpTableStop[] = {(char)OOB_TABLE_CLOSE, '\0'};
-
-      char* pTable = (char*)malloc(strlen(apValue) + 3); /* 3: START, STOP, NUL */
+      string Table;
 
-      strcpy(pTable, MsdpTableStart);
-      strcat(pTable, apValue);
-      strcat(pTable, MsdpTableStop);
+      Table.reserve(strlen(apValue) + 2); /* 2: START, STOP */
+      Table += (char)OOB_TABLE_OPEN;
+      Table += apValue;
+      Table += (char)OOB_TABLE_CLOSE;
 
-      if (strcmp(pProtocol->pVariables[aOOB]->pValueString, pTable)) {
-        free(pProtocol->pVariables[aOOB]->pValueString);
-        pProtocol->pVariables[aOOB]->pValueString = pTable;
-        pProtocol->pVariables[aOOB]->bDirty = true;
-      } else /* Just discard the table, we've already got one */
-      {
-        free(pTable);
+      if (pProtocol->Variables.ValueString[aOOB] != Table) {
+        pProtocol->Variables.ValueString[aOOB] = std::move(Table);
+        OOBMarkDirty(apDescriptor, OOB_BIT(aOOB));
       }
     }
   }
@@ -1410,25 +2018,300 @@ void OOBSetArray(dPtr apDescriptor, variable_t aOOB, const char* apValue)
       /* It's easier to call OOBSetString if the value is empty */
       OOBSetString(apDescriptor, aOOB, apValue);
     } else if (VariableNameTable[aOOB].bString) {
-      const char MsdpArrayStart[] = {(char)OOB_ARRAY_OPEN, '\0'};
-      const char MsdpArrayStop[] = {(char)OOB_ARRAY_CLOSE, '\0'};
+      string Array;
 
-      char* pArray = (char*)malloc(strlen(apValue) + 3); /* 3: START, STOP, NUL */
+      Array.reserve(strlen(apValue) + 2); /* 2: START, STOP */
+      Array += (char)OOB_ARRAY_OPEN;
+      Array += apValue;
+      Array += (char)OOB_ARRAY_CLOSE;
 
-      strcpy(pArray, MsdpArrayStart);
-      strcat(pArray, apValue);
-      strcat(pArray, MsdpArrayStop);
+      if (pProtocol->Variables.ValueString[aOOB] != Array) {
+        pProtocol->Variables.ValueString[aOOB] = std::move(Array);
+        OOBMarkDirty(apDescriptor, OOB_BIT(aOOB));
+      }
+    }
+  }
+}
 
-      if (strcmp(pProtocol->pVariables[aOOB]->pValueString, pArray)) {
-        free(pProtocol->pVariables[aOOB]->pValueString);
-        pProtocol->pVariables[aOOB]->pValueString = pArray;
-        pProtocol->pVariables[aOOB]->bDirty = true;
-      } else /* Just discard the array, we've already got one */
-      {
-        free(pArray);
+/******************************************************************************
+ MCCP global functions.
+ ******************************************************************************/
+
+void CompressSetProfile(compress_class_t aClass, const compress_profile_t& aProfile)
+{
+  if (aClass < 0 || aClass >= eCOMPRESS_MAX)
+    ReportBug("CompressSetProfile: Invalid connection class.\n");
+  else if (aProfile.Level < Z_DEFAULT_COMPRESSION || aProfile.Level > 9 || aProfile.WindowBits < 9 ||
+           aProfile.WindowBits > 15 || aProfile.MemLevel < 1 || aProfile.MemLevel > 9 ||
+           aProfile.Strategy < Z_DEFAULT_STRATEGY || aProfile.Strategy > Z_FIXED)
+    ReportBug("CompressSetProfile: Invalid zlib settings.\n");
+  else
+    s_CompressProfiles[aClass] = aProfile;
+}
+
+const compress_profile_t& CompressGetProfile(compress_class_t aClass)
+{
+  if (aClass < 0 || aClass >= eCOMPRESS_MAX)
+    aClass = eCOMPRESS_NORMAL;
+
+  return s_CompressProfiles[aClass];
+}
+
+void* z_alloc(void* opaque, uInt items, uInt size)
+{
+  size_t Bytes = (size_t)items * size;
+  zlib_block_t* pBlock = NULL;
+  lock_guard<mutex> Lock(s_ZlibPoolMutex);
+
+  ++s_ZlibPoolStats.Allocs;
+
+  auto Pool = s_ZlibPool.find(Bytes);
+  if (Pool != s_ZlibPool.end() && !Pool->second.empty()) {
+    pBlock = Pool->second.back();
+    Pool->second.pop_back();
+    ++s_ZlibPoolStats.Hits;
+    s_ZlibPoolStats.PooledBytes -= Bytes;
+    --s_ZlibPoolStats.PooledBlocks;
+  } else if ((pBlock = (zlib_block_t*)malloc(sizeof(zlib_block_t) + Bytes)) == NULL) {
+    return Z_NULL;
+  }
+
+  pBlock->Size = Bytes;
+  s_ZlibPoolStats.InUseBytes += Bytes;
+  return pBlock + 1;
+}
+
+void z_free(void* opaque, void* address)
+{
+  zlib_block_t* pBlock;
+
+  if (address == NULL)
+    return;
+
+  pBlock = (zlib_block_t*)address - 1;
+  lock_guard<mutex> Lock(s_ZlibPoolMutex);
+
+  ++s_ZlibPoolStats.Frees;
+  s_ZlibPoolStats.InUseBytes -= pBlock->Size;
+
+  if (s_ZlibPoolStats.PooledBytes + pBlock->Size > MAX_ZLIB_POOL) {
+    ++s_ZlibPoolStats.Released;
+    free(pBlock);
+    return;
+  }
+
+  s_ZlibPool[pBlock->Size].push_back(pBlock);
+  s_ZlibPoolStats.PooledBytes += pBlock->Size;
+  ++s_ZlibPoolStats.PooledBlocks;
+}
+
+void CompressReserve(compress_class_t aClass, int aStreams)
+{
+  vector<z_stream*> Streams;
+  int i; /* Loop counter */
+
+  /* Start them all at once, so they can't just reuse each other's memory */
+  for (i = 0; i < aStreams; ++i) {
+    z_stream* pStream = DeflateCreate(CompressGetProfile(aClass));
+
+    if (pStream == NULL)
+      break;
+    Streams.push_back(pStream);
+  }
+
+  for (z_stream* pStream : Streams) {
+    deflateEnd(pStream);
+    delete pStream;
+  }
+}
+
+zlib_pool_stats_t ZlibPoolStats(void)
+{
+  lock_guard<mutex> Lock(s_ZlibPoolMutex);
+
+  return s_ZlibPoolStats;
+}
+
+string CompressBuildDictionary(const vector<string>& aSamples, size_t aMaxSize)
+{
+  unordered_map<string_view, size_t> Counts;
+  vector<pair<size_t, string_view>> Lines; /* The bytes each would save */
+  vector<string_view> Chosen;
+  string Builtin, Dictionary;
+  size_t Room;
+  int i; /* Loop counter */
+
+  if (aMaxSize > MAX_DICTIONARY)
+    aMaxSize = MAX_DICTIONARY;
+
+  /* The GMCP headers (one per category) and keys, if OOBInit() has run */
+  for (i = eOOB_NONE + 1; i < eOOB_MAX && !s_VariableSlots.empty(); ++i) {
+    if (__builtin_ctzll(s_OOBCategoryMask[i]) == i)
+      Builtin += s_GMCPHeader[i];
+    Builtin += s_GMCPKey[i];
+  }
+  if (Builtin.length() > aMaxSize)
+    Builtin.erase(0, Builtin.length() - aMaxSize);
+  Room = aMaxSize - Builtin.length();
+
+  /* Then the lines that turn up more than once in the samples */
+  for (const string& Sample : aSamples) {
+    string_view Text = Sample;
+
+    while (!Text.empty()) {
+      size_t End = Text.find('\n');
+      string_view Line = Text.substr(0, End == string_view::npos ? End : End + 1);
+
+      Text.remove_prefix(Line.length());
+      if (Line.length() >= MIN_DICTIONARY_LINE)
+        ++Counts[Line];
+    }
+  }
+
+  for (const auto& Count : Counts) {
+    if (Count.second > 1)
+      Lines.push_back({(Count.second - 1) * Count.first.length(), Count.first});
+  }
+  sort(Lines.begin(), Lines.end(), [](const auto& aFirst, const auto& aSecond) { return aFirst.first > aSecond.first; });
+
+  for (const auto& Line : Lines) {
+    if (Line.second.length() <= Room) {
+      Chosen.push_back(Line.second);
+      Room -= Line.second.length();
+    }
+  }
+
+  /* zlib finds the closest matches cheapest, so the most useful go last */
+  Dictionary.reserve(aMaxSize - Room);
+  for (auto Line = Chosen.rbegin(); Line != Chosen.rend(); ++Line)
+    Dictionary.append(*Line);
+  Dictionary += Builtin;
+
+  return Dictionary;
+}
+
+string CompressBenchmark(const vector<string>& aSamples, const string& aDictionary)
+{
+  char Buffer[MAX_STRING_LENGTH];
+  string Report;
+  string Output;
+  size_t Input = 0;
+  int i, Pass; /* Loop counters */
+
+  for (const string& Sample : aSamples)
+    Input += Sample.length();
+
+  if (Input == 0)
+    return "There's nothing to compress.\n";
+
+  snprintf(Buffer, sizeof(Buffer), "%-8s %5s %6s %3s %4s %8s %8s %9s %8s\n", "Profile", "Level", "Window", "Mem",
+           "Dict", "Bytes", "Ratio", "CPU ms/MB", "Memory");
+  Report += Buffer;
+
+  for (i = 0; i < eCOMPRESS_MAX; ++i) {
+    for (Pass = 0; Pass < (aDictionary.empty() ? 1 : 2); ++Pass) {
+      compress_profile_t Profile = s_CompressProfiles[i];
+      size_t Compressed = 0;
+      z_stream* pStream;
+      clock_t Start;
+      double CPU;
+
+      Profile.Dictionary = Pass ? aDictionary : string();
+      if ((pStream = DeflateCreate(Profile)) == NULL)
+        continue;
+
+      Start = clock();
+      for (const string& Sample : aSamples) {
+        /* Compress each sample the way ProtocolFlush() does a pulse */
+        pStream->next_in = (Bytef*)Sample.data();
+        pStream->avail_in = (uInt)Sample.length();
+        do {
+          Output.resize(Sample.length() + MIN_DEFLATE_ROOM);
+          pStream->next_out = (Bytef*)&Output[0];
+          pStream->avail_out = (uInt)Output.length();
+          deflate(pStream, Z_SYNC_FLUSH);
+          Compressed += Output.length() - pStream->avail_out;
+        } while (pStream->avail_out == 0);
       }
+      CPU = (double)(clock() - Start) * 1000 / CLOCKS_PER_SEC;
+      deflateEnd(pStream);
+      delete pStream;
+
+      snprintf(Buffer, sizeof(Buffer), "%-8s %5d %6d %3d %4s %8zu %6.2f:1 %9.1f %7dK\n", s_CompressClassNames[i],
+               Profile.Level, Profile.WindowBits, Profile.MemLevel, Pass ? "Yes" : "No", Compressed,
+               Compressed ? (double)Input / Compressed : 0.0, CPU * 1048576 / Input,
+               ((1 << (Profile.WindowBits + 2)) + (1 << (Profile.MemLevel + 9))) / 1024);
+      Report += Buffer;
     }
   }
+
+  return Report;
+}
+
+bool CompressCheck(void)
+{
+  descriptor_data Descriptor = descriptor_data();
+  z_stream Inflate = z_stream();
+  string Expected, Received, Inflated;
+  char Buffer[MAX_STRING_LENGTH];
+  int Sockets[2];
+  ssize_t Size;
+  int Result;
+  int i; /* Loop counter */
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, Sockets) < 0)
+    return false;
+
+  fcntl(Sockets[0], F_SETFL, fcntl(Sockets[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(Sockets[1], F_SETFL, fcntl(Sockets[1], F_GETFL, 0) | O_NONBLOCK);
+  Descriptor.descriptor = Sockets[0];
+  Descriptor.pProtocol = ProtocolCreate();
+  Descriptor.pProtocol->bMCCP = true;
+  CompressStart(&Descriptor);
+
+  /* Some pulses of output, with protocol data queued in front of the text */
+  for (i = 0; i < 64; ++i) {
+    string Text = "You are standing in room " + to_string(i) + ".  Exits: north south.\r\n";
+    string Data = "Room.Info {\"num\": " + to_string(i) + "}";
+
+    Queue(&Descriptor, Data);
+    Expected += Data + Text;
+    if (ProtocolFlush(&Descriptor, Text) < 0)
+      break;
+    while ((Size = recv(Sockets[1], Buffer, sizeof(Buffer), MSG_DONTWAIT)) > 0)
+      Received.append(Buffer, Size);
+  }
+
+  /* Then end it as a copyover would, and carry on in plain text */
+  CompressFinishAll({&Descriptor});
+  const bool bFinished = i == 64 && CompressFinished(Descriptor.pProtocol);
+  const string Plain = "Copyover complete.\r\n";
+  ProtocolFlush(&Descriptor, Plain);
+  while ((Size = recv(Sockets[1], Buffer, sizeof(Buffer), MSG_DONTWAIT)) > 0)
+    Received.append(Buffer, Size);
+
+  ProtocolDestroy(Descriptor.pProtocol);
+  close(Sockets[0]);
+  close(Sockets[1]);
+
+  /* Now be the client: everything after the start sequence is compressed */
+  if (!bFinished || Received.compare(0, strlen(COMPRESS_START), COMPRESS_START) || inflateInit(&Inflate) != Z_OK)
+    return false;
+
+  Inflate.next_in = (Bytef*)Received.data() + strlen(COMPRESS_START);
+  Inflate.avail_in = (uInt)(Received.length() - strlen(COMPRESS_START));
+  do {
+    Inflate.next_out = (Bytef*)Buffer;
+    Inflate.avail_out = sizeof(Buffer);
+    Result = inflate(&Inflate, Z_NO_FLUSH);
+    Inflated.append(Buffer, sizeof(Buffer) - Inflate.avail_out);
+  } while (Result == Z_OK);
+
+  /* The stream must end cleanly, and leave just the plain text after it */
+  const bool bResult = Result == Z_STREAM_END && Inflated == Expected
+                       && string_view((const char*)Inflate.next_in, Inflate.avail_in) == Plain;
+  inflateEnd(&Inflate);
+  return bResult;
 }
 
 /******************************************************************************
@@ -1443,6 +2326,89 @@ void MSSPSetPlayers(int aPlayers)
     s_Uptime = time(0);
 }
 
+bool MSSPProbeAccept(int aSocket, bool abDedicated)
+{
+  static const char WillMSSP[] = {(char)IAC, (char)WILL, TELOPT_MSSP};
+  mssp_probe_t Probe = {aSocket, eMSSP_PROBE_WAITING, time(0), string(), gmcp_payload_t(), 0};
+  char Buffer[MAX_MSSP_PROBE_INPUT];
+  ssize_t Size;
+
+  if (!abDedicated) {
+    /* Only take it over if it's already asked, and leave the input for the
+     * mud if it hasn't.
+     */
+    Size = recv(aSocket, Buffer, sizeof(Buffer), MSG_PEEK | MSG_DONTWAIT);
+    if (Size <= 0)
+      return false;
+
+    Probe.Input.assign(Buffer, Size);
+    if (!MSSPProbeParse(Probe, false))
+      return false;
+
+    /* It's ours now, so the request can be read */
+    if (recv(aSocket, Buffer, Size, MSG_DONTWAIT) < 0) {
+      CLOSE_SOCKET(aSocket);
+      return true;
+    }
+  }
+
+  if (s_MSSPProbes.size() >= MAX_MSSP_PROBES) {
+    CLOSE_SOCKET(aSocket);
+    return true;
+  }
+
+  fcntl(aSocket, F_SETFL, fcntl(aSocket, F_GETFL, 0) | O_NONBLOCK);
+
+  if (Probe.State == eMSSP_PROBE_REPLYING)
+    MSSPProbeWrite(Probe);
+  else if (write(aSocket, WillMSSP, sizeof(WillMSSP)) != sizeof(WillMSSP))
+    Probe.State = eMSSP_PROBE_DONE;
+
+  if (Probe.State == eMSSP_PROBE_DONE)
+    CLOSE_SOCKET(aSocket);
+  else
+    s_MSSPProbes.push_back(std::move(Probe));
+
+  return true;
+}
+
+void MSSPProbeUpdate(void)
+{
+  const time_t Now = time(0);
+  char Buffer[MAX_MSSP_PROBE_INPUT];
+  size_t i = 0;
+
+  while (i < s_MSSPProbes.size()) {
+    mssp_probe_t& Probe = s_MSSPProbes[i];
+
+    if (Probe.State == eMSSP_PROBE_WAITING) {
+      ssize_t Size = recv(Probe.Socket, Buffer, sizeof(Buffer), MSG_DONTWAIT);
+
+      if (Size > 0) {
+        Probe.Input.append(Buffer, Size);
+        if (!MSSPProbeParse(Probe, true))
+          Probe.State = eMSSP_PROBE_DONE;
+      } else if (Size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        Probe.State = eMSSP_PROBE_DONE;
+      }
+    }
+
+    if (Probe.State == eMSSP_PROBE_REPLYING)
+      MSSPProbeWrite(Probe);
+
+    if (Probe.State == eMSSP_PROBE_DONE || Now - Probe.Started > MSSP_PROBE_TIMEOUT) {
+      CLOSE_SOCKET(Probe.Socket);
+
+      /* The order doesn't matter, so fill the gap from the end */
+      if (i != s_MSSPProbes.size() - 1)
+        Probe = std::move(s_MSSPProbes.back());
+      s_MSSPProbes.pop_back();
+    } else {
+      ++i;
+    }
+  }
+}
+
 /******************************************************************************
  MXP global functions.
  ******************************************************************************/
@@ -1451,7 +2417,7 @@ const char* MXPCreateTag(dPtr apDescriptor, const char* apTag)
 {
   protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-  if (pProtocol != NULL && pProtocol->pVariables[eOOB_MXP]->ValueInt && strlen(apTag) < 1000) {
+  if (pProtocol != NULL && pProtocol->Variables.ValueInt[eOOB_MXP] && strlen(apTag) < 1000) {
     static char MXPBuffer[1024];
     sprintf(MXPBuffer, "\033[1z%s\033[7z", apTag);
     return MXPBuffer;
@@ -1465,7 +2431,7 @@ void MXPSendTag(dPtr apDescriptor, const char* apTag)
 {
   protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-  if (pProtocol != NULL && pProtocol->pVariables[eOOB_MXP]->ValueInt && strlen(apTag) < 1000) {
+  if (pProtocol != NULL && pProtocol->Variables.ValueInt[eOOB_MXP] && strlen(apTag) < 1000) {
     char MXPBuffer[1024];
     sprintf(MXPBuffer, "\033[1z%s\033[7z\r\n", apTag);
     Write(apDescriptor, MXPBuffer);
@@ -1483,7 +2449,7 @@ void SoundSend(dPtr apDescriptor, const char* apTrigger)
   if (apDescriptor != NULL && apTrigger != NULL) {
     protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-    if (pProtocol != NULL && pProtocol->pVariables[eOOB_SOUND]->ValueInt) {
+    if (pProtocol != NULL && pProtocol->Variables.ValueInt[eOOB_SOUND]) {
       if (pProtocol->bMSDP || pProtocol->bGMCP) {
         /* Send the sound trigger through MSDP or GMCP */
         OOBSendPair(apDescriptor, "PLAY_SOUND", apTrigger);
@@ -1503,70 +2469,671 @@ void SoundSend(dPtr apDescriptor, const char* apTrigger)
 
 const char* ColourRGB(dPtr apDescriptor, const char* apRGB)
 {
-  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
-  bool charHasColor = TRUE;
-
-  if (apDescriptor->character && !clr(apDescriptor->character, C_CMP))
-    charHasColor = FALSE;
-
-  if (pProtocol && pProtocol->pVariables[eOOB_ANSI_COLORS]->ValueInt && charHasColor) {
-    if (IsValidColour(apRGB)) {
-      bool bBackground = (tolower(apRGB[0]) == 'b');
-      int Red = apRGB[1] - '0';
-      int Green = apRGB[2] - '0';
-      int Blue = apRGB[3] - '0';
-
-      if (pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt)
-        return GetRGBColour(bBackground, Red, Green, Blue);
-      else /* Use regular ANSI colour */
-        return GetAnsiColour(bBackground, Red, Green, Blue);
-    } else /* Invalid colour - use this to clear any existing colour. */
-    {
-      return s_Clean;
+  return GetColour(GetColourMode(apDescriptor), ColourIndex(apRGB));
+}
+
+/******************************************************************************
+ UTF-8 global functions.
+ ******************************************************************************/
+
+char* UnicodeGet(int aValue)
+{
+  static char Buffer[8];
+  char* pString = Buffer;
+
+  UnicodeAdd(&pString, aValue);
+  *pString = '\0';
+
+  return Buffer;
+}
+
+void UnicodeAdd(char** apString, int aValue)
+{
+  if (aValue < 0x80) {
+    *(*apString)++ = (char)aValue;
+  } else if (aValue < 0x800) {
+    *(*apString)++ = (char)(0xC0 | (aValue >> 6));
+    *(*apString)++ = (char)(0x80 | (aValue & 0x3F));
+  } else if (aValue < 0x10000) {
+    *(*apString)++ = (char)(0xE0 | (aValue >> 12));
+    *(*apString)++ = (char)(0x80 | (aValue >> 6 & 0x3F));
+    *(*apString)++ = (char)(0x80 | (aValue & 0x3F));
+  } else if (aValue < 0x200000) {
+    *(*apString)++ = (char)(0xF0 | (aValue >> 18));
+    *(*apString)++ = (char)(0x80 | (aValue >> 12 & 0x3F));
+    *(*apString)++ = (char)(0x80 | (aValue >> 6 & 0x3F));
+    *(*apString)++ = (char)(0x80 | (aValue & 0x3F));
+  }
+}
+
+/******************************************************************************
+ Local output cache functions.
+ ******************************************************************************/
+
+static unsigned int OutputCacheCaps(protocol_t* apProtocol, colour_mode_t aColourMode, bool abUseMSP)
+{
+  unsigned int Caps = (unsigned int)aColourMode;
+
+  if (apProtocol->Variables.ValueInt[eOOB_UTF_8])
+    Caps |= 1 << 2;
+  if (apProtocol->Variables.ValueInt[eOOB_MXP])
+    Caps |= 1 << 3;
+  if (abUseMSP)
+    Caps |= 1 << 4;
+  if (apProtocol->bBlockMXP)
+    Caps |= 1 << 5;
+
+  return Caps;
+}
+
+static size_t OutputCacheKey(string_view aData, unsigned int aCaps, const char* apMXPVersion)
+{
+  size_t Key = hash<string_view>()(aData);
+  Key ^= hash<string_view>()(apMXPVersion) + 0x9e3779b9 + (Key << 6) + (Key >> 2);
+  Key ^= aCaps + 0x9e3779b9 + (Key << 6) + (Key >> 2);
+  return Key;
+}
+
+static output_cache_t* OutputCacheFind(size_t aKey, string_view aData, unsigned int aCaps, const char* apMXPVersion)
+{
+  /* Everything cached was rendered with the old primary colours */
+  string Primary = string(RGBone) + RGBtwo + RGBthree;
+  if (Primary != s_OutputCachePrimary) {
+    s_OutputCacheIndex.clear();
+    s_OutputCache.clear();
+    s_OutputCachePrimary = Primary;
+    return NULL;
+  }
+
+  auto Found = s_OutputCacheIndex.find(aKey);
+
+  if (Found == s_OutputCacheIndex.end())
+    return NULL;
+
+  /* Make sure it's not just a hash collision */
+  auto Iter = Found->second;
+  if (Iter->Caps != aCaps || Iter->Source != aData || Iter->MXPVersion != apMXPVersion)
+    return NULL;
+
+  /* Move it to the front, it's the most recently used */
+  s_OutputCache.splice(s_OutputCache.begin(), s_OutputCache, Iter);
+  return &*Iter;
+}
+
+static void OutputCacheAdd(size_t aKey, string_view aData, unsigned int aCaps, const char* apMXPVersion,
+                           string_view aResult, bool abBlockMXP)
+{
+  /* Most text is only sent once, so just note it the first time */
+  size_t& Seen = s_OutputCacheSeen[aKey % MAX_OUTPUT_CACHE_SEEN];
+  if (Seen != aKey) {
+    Seen = aKey;
+    return;
+  }
+
+  /* Replace whatever was using the key before (a hash collision) */
+  auto Found = s_OutputCacheIndex.find(aKey);
+  if (Found != s_OutputCacheIndex.end()) {
+    s_OutputCache.erase(Found->second);
+    s_OutputCacheIndex.erase(Found);
+  }
+
+  /* Throw away the least recently used entry if we're full */
+  if (s_OutputCache.size() >= MAX_OUTPUT_CACHE) {
+    s_OutputCacheIndex.erase(s_OutputCache.back().Key);
+    s_OutputCache.pop_back();
+  }
+
+  s_OutputCache.push_front({aKey, aCaps, apMXPVersion, string(aData), string(aResult), abBlockMXP});
+  s_OutputCacheIndex[aKey] = s_OutputCache.begin();
+}
+
+/******************************************************************************
+ Local framing functions.
+ ******************************************************************************/
+
+/* These build IAC SB <option> ... IAC SE subnegotiations onto the end of a
+ * string, which grows as needed, so there's no limit on the size.
+ */
+
+static void FrameStart(string& aFrame, char aOption)
+{
+  aFrame += (char)IAC;
+  aFrame += (char)SB;
+  aFrame += aOption;
+}
+
+/* Any IAC in the data is doubled, so it can't end the subnegotiation early */
+static void FrameAppend(string& aFrame, string_view aData)
+{
+  size_t Start = 0, Pos;
+
+  while ((Pos = aData.find((char)IAC, Start)) != string_view::npos) {
+    aFrame.append(aData.data() + Start, Pos + 1 - Start);
+    aFrame += (char)IAC;
+    Start = Pos + 1;
+  }
+
+  aFrame.append(aData.data() + Start, aData.length() - Start);
+}
+
+static void FrameAppendNumber(string& aFrame, int aValue)
+{
+  char Number[16]; /* Big enough for any int */
+  char* pEnd = to_chars(Number, Number + sizeof(Number), aValue).ptr;
+
+  aFrame.append(Number, pEnd - Number);
+}
+
+static void FrameEnd(string& aFrame)
+{
+  aFrame += (char)IAC;
+  aFrame += (char)SE;
+}
+
+/* A space separated list, sent as an array under MSDP */
+static void FrameList(string& aFrame, bool abGMCP, const char* apVariable, const char* apValue)
+{
+  if (abGMCP) {
+    FrameStart(aFrame, (char)TELOPT_GMCP);
+    aFrame += "GMCP.";
+    FrameAppend(aFrame, apVariable);
+    aFrame += ' ';
+    FrameAppend(aFrame, apValue);
+    FrameEnd(aFrame);
+  } else {
+    size_t Start;
+    size_t i; /* Loop counter */
+
+    FrameStart(aFrame, (char)TELOPT_MSDP);
+    aFrame += (char)OOB_VAR;
+    FrameAppend(aFrame, apVariable);
+    aFrame += (char)OOB_VAL;
+    aFrame += (char)OOB_ARRAY_OPEN;
+    aFrame += (char)OOB_VAL;
+
+    /* Each space separated word is an element of the array */
+    Start = aFrame.length();
+    FrameAppend(aFrame, apValue);
+    for (i = Start; i < aFrame.length(); ++i) {
+      if (aFrame[i] == ' ')
+        aFrame[i] = OOB_VAL;
     }
-  } else /* Don't send any colour, not even clear */
-  {
-    return "";
+
+    aFrame += (char)OOB_ARRAY_CLOSE;
+    FrameEnd(aFrame);
+  }
+}
+
+/******************************************************************************
+ Local output queue functions.
+ ******************************************************************************/
+
+/* Returns the string at the end of the queue, for the caller to build its
+ * message directly onto, so small messages share a chunk.
+ */
+static string& QueueBuffer(dPtr apDescriptor)
+{
+  deque<output_chunk_t>& OutputQueue = apDescriptor->pProtocol->OutputQueue;
+
+  NoteOOB(apDescriptor);
+  if (OutputQueue.empty() || OutputQueue.back().pShared || OutputQueue.back().Type != eCHUNK_DATA)
+    OutputQueue.emplace_back();
+
+  return OutputQueue.back().Data;
+}
+
+static void Queue(dPtr apDescriptor, string_view aData)
+{
+  QueueBuffer(apDescriptor).append(aData);
+}
+
+static void QueueShared(dPtr apDescriptor, const gmcp_payload_t& apPayload)
+{
+  NoteOOB(apDescriptor);
+  apDescriptor->pProtocol->OutputQueue.push_back({string(), apPayload, eCHUNK_DATA});
+}
+
+/* Sets a TCP option, if the platform has it.  Failures are ignored, as the
+ * output still goes out without it.
+ */
+static void SetSocketOption(socket_t aSocket, int aOption, int aValue)
+{
+  ++s_FlushStats.Syscalls;
+  setsockopt(aSocket, IPPROTO_TCP, aOption, (const char*)&aValue, sizeof(aValue));
+}
+
+/* Returns a new deflate stream with the profile's settings, or NULL */
+static z_stream* DeflateCreate(const compress_profile_t& aProfile)
+{
+  z_stream* pStream = new z_stream();
+
+  pStream->zalloc = z_alloc;
+  pStream->zfree = z_free;
+  pStream->opaque = Z_NULL;
+
+  if (deflateInit2(pStream, aProfile.Level, Z_DEFLATED, aProfile.WindowBits, aProfile.MemLevel, aProfile.Strategy) !=
+      Z_OK) {
+    ReportBug("MCCP: deflateInit2() failed.\n");
+    delete pStream;
+    return NULL;
+  }
+
+  if (!aProfile.Dictionary.empty() &&
+      deflateSetDictionary(pStream, (const Bytef*)aProfile.Dictionary.data(), (uInt)aProfile.Dictionary.length()) !=
+          Z_OK) {
+    ReportBug("MCCP: deflateSetDictionary() failed.\n");
+    deflateEnd(pStream);
+    delete pStream;
+    return NULL;
+  }
+
+  return pStream;
+}
+
+/* Runs the data through the MCCP stream onto the end of the deflated output,
+ * growing it as needed.
+ */
+static void Deflate(protocol_t* apProtocol, string_view aData, int aFlush)
+{
+  z_stream* pStream = apProtocol->pDeflate;
+  string& Deflated = apProtocol->Deflated;
+  int Result;
+
+  pStream->next_in = (Bytef*)aData.data();
+  pStream->avail_in = (uInt)aData.length();
+
+  do {
+    size_t Used = Deflated.length();
+    size_t Room = pStream->avail_in + MIN_DEFLATE_ROOM;
+
+    Deflated.resize(Used + Room);
+    pStream->next_out = (Bytef*)&Deflated[Used];
+    pStream->avail_out = (uInt)Room;
+    Result = deflate(pStream, aFlush);
+    Deflated.resize(Used + Room - pStream->avail_out);
+  } while (Result == Z_OK && (pStream->avail_in > 0 || pStream->avail_out == 0));
+
+  if (Result != Z_OK && Result != Z_STREAM_END && Result != Z_BUF_ERROR) {
+    do_log("SYSERR: deflate returned %d. (in: %d, out: %d)", Result, pStream->avail_in, pStream->avail_out);
+  }
+}
+
+/* Moves the whole queue, then the text, into the deflated output, starting
+ * and finishing the MCCP stream where the queue says to.  The stream is
+ * flushed at the end, so the client can show everything up to the prompt.
+ */
+static void DeflateQueue(dPtr apDescriptor, string_view aText)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  deque<output_chunk_t>& OutputQueue = pProtocol->OutputQueue;
+  bool bPending = false; /* Data has gone in since the last flush */
+
+  for (; !OutputQueue.empty(); OutputQueue.pop_front()) {
+    const output_chunk_t& Chunk = OutputQueue.front();
+    string_view Data = Chunk.pShared ? *Chunk.pShared : Chunk.Data;
+
+    /* The plain path may have sent some of it before MCCP was queued */
+    Data.remove_prefix(pProtocol->OutputOffset);
+    pProtocol->OutputOffset = 0;
+
+    switch (Chunk.Type) {
+    case eCHUNK_COMPRESS_START:
+      --pProtocol->CompressMarkers;
+      if (pProtocol->pDeflate != NULL)
+        break;
+
+      /* The start sequence itself is the last thing sent uncompressed */
+      pProtocol->Deflated.append(COMPRESS_START);
+      pProtocol->pDeflate = DeflateCreate(CompressGetProfile(pProtocol->CompressClass));
+      break;
+
+    case eCHUNK_COMPRESS_END:
+      --pProtocol->CompressMarkers;
+      if (pProtocol->pDeflate == NULL)
+        break;
+
+      Deflate(pProtocol, string_view(), Z_FINISH);
+      deflateEnd(pProtocol->pDeflate);
+      delete pProtocol->pDeflate;
+      pProtocol->pDeflate = NULL;
+      bPending = false;
+      break;
+
+    default: /* eCHUNK_DATA */
+      if (pProtocol->pDeflate == NULL) {
+        pProtocol->Deflated.append(Data);
+      } else if (!Data.empty()) {
+        Deflate(pProtocol, Data, Z_NO_FLUSH);
+        bPending = true;
+      }
+      break;
+    }
+  }
+
+  if (pProtocol->pDeflate == NULL) {
+    pProtocol->Deflated.append(aText);
+  } else if (bPending || !aText.empty()) {
+    Deflate(pProtocol, aText, Z_SYNC_FLUSH);
+  }
+}
+
+/* ProtocolFlush() for MCCP.  It always takes the lot, so there's nothing to
+ * queue afterwards - anything the socket won't take stays in Deflated.
+ */
+static ssize_t FlushDeflated(dPtr apDescriptor, string_view aText)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  string& Deflated = pProtocol->Deflated;
+  ssize_t Sent;
+
+  DeflateQueue(apDescriptor, aText);
+
+  if (Deflated.length() == pProtocol->DeflatedOffset)
+    return 0;
+
+  ++s_FlushStats.Flushes;
+  ++s_FlushStats.Syscalls;
+  Sent = write(apDescriptor->descriptor, Deflated.data() + pProtocol->DeflatedOffset,
+               Deflated.length() - pProtocol->DeflatedOffset);
+  if (Sent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      return (-1);
+    Sent = 0;
+  }
+
+  s_FlushStats.Bytes += Sent;
+  pProtocol->DeflatedOffset += Sent;
+
+  if (pProtocol->DeflatedOffset == Deflated.length()) {
+    /* Keep the buffer for next time, it'll usually be about the same size */
+    Deflated.clear();
+    pProtocol->DeflatedOffset = 0;
+  } else {
+    ++s_FlushStats.Blocked;
+
+    /* Don't let what's already gone pile up in front of what hasn't */
+    if (pProtocol->DeflatedOffset > Deflated.length() / 2) {
+      Deflated.erase(0, pProtocol->DeflatedOffset);
+      pProtocol->DeflatedOffset = 0;
+    }
+
+    if (OutputOverflow(apDescriptor))
+      return (-1);
+  }
+
+  return Sent;
+}
+
+/* Returns true once the MCCP stream has ended and all of it has been sent,
+ * so the client is reading plain text again.
+ */
+static bool CompressFinished(protocol_t* apProtocol)
+{
+  return apProtocol->pDeflate == NULL && apProtocol->CompressMarkers == 0 && apProtocol->Deflated.empty();
+}
+
+/* Ends the MCCP streams of all the descriptors, then flushes them together
+ * until every stream has been sent or MCCP_FINISH_WAIT milliseconds have
+ * passed, so one slow client doesn't hold up the rest.  Check each one with
+ * CompressFinished() afterwards.
+ */
+static void CompressFinishAll(const vector<dPtr>& aDescriptors)
+{
+  const auto Deadline = chrono::steady_clock::now() + chrono::milliseconds(MCCP_FINISH_WAIT);
+  vector<dPtr> Pending;
+  vector<struct pollfd> Poll;
+
+  for (dPtr pDescriptor : aDescriptors) {
+    if (pDescriptor->pProtocol != NULL && pDescriptor->pProtocol->bMCCP) {
+      CompressEnd(pDescriptor);
+      Pending.push_back(pDescriptor);
+    }
+  }
+
+  for (;;) {
+    /* Send what each can take, and stop waiting on those that are done */
+    Pending.erase(remove_if(Pending.begin(), Pending.end(),
+                            [](dPtr apDescriptor) {
+                              return ProtocolFlush(apDescriptor) < 0 || CompressFinished(apDescriptor->pProtocol);
+                            }),
+                  Pending.end());
+
+    const auto Left = chrono::duration_cast<chrono::milliseconds>(Deadline - chrono::steady_clock::now()).count();
+    if (Pending.empty() || Left <= 0)
+      return;
+
+    Poll.clear();
+    for (dPtr pDescriptor : Pending)
+      Poll.push_back({pDescriptor->descriptor, POLLOUT, 0});
+    poll(Poll.data(), Poll.size(), (int)Left);
+  }
+}
+
+/* Returns true if the client has so much unsent output that it's clearly
+ * stopped reading.
+ */
+static bool OutputOverflow(dPtr apDescriptor)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  size_t Pending = pProtocol->Deflated.length() - pProtocol->DeflatedOffset;
+
+  for (const output_chunk_t& Chunk : pProtocol->OutputQueue) {
+    Pending += Chunk.pShared ? Chunk.pShared->length() : Chunk.Data.length();
+    if (Pending > MAX_OUTPUT_QUEUE + pProtocol->OutputOffset)
+      break;
+  }
+
+  if (Pending <= MAX_OUTPUT_QUEUE + pProtocol->OutputOffset)
+    return false;
+
+  do_log("Output: %s has over %d bytes waiting, closing the connection.", pProtocol->Host.c_str(),
+         MAX_OUTPUT_QUEUE);
+  return true;
+}
+
+/******************************************************************************
+ Local decompression functions.
+ ******************************************************************************/
+
+/* Called when the client sends IAC SB MCCP3 IAC SE.  Returns true if its
+ * stream has started, in which case everything after that is compressed.
+ */
+static bool InflateStart(dPtr apDescriptor)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+
+  if (!pProtocol->bMCCP3 || pProtocol->pInflate != NULL)
+    return false;
+
+  pProtocol->pInflate = new z_stream();
+  pProtocol->pInflate->zalloc = z_alloc;
+  pProtocol->pInflate->zfree = z_free;
+  pProtocol->pInflate->opaque = Z_NULL;
+  if (inflateInit(pProtocol->pInflate) != Z_OK) {
+    ReportBug("MCCP3: inflateInit() failed.\n");
+    delete pProtocol->pInflate;
+    pProtocol->pInflate = NULL;
+    pProtocol->bMCCP3 = false;
+    Queue(apDescriptor, WONT_MCCP3);
+    return false;
+  }
+
+  return true;
+}
+
+static void InflateEnd(protocol_t* apProtocol)
+{
+  inflateEnd(apProtocol->pInflate);
+  delete apProtocol->pInflate;
+  apProtocol->pInflate = NULL;
+}
+
+/* After a copyover, drops what's left of the old MCCP3 stream, which the new
+ * process can't inflate.  That ends with the client's IAC WILL/WONT TM, or
+ * after MCCP3_SKIP_WAIT seconds in case it never answers.  Returns how much
+ * of the input it used.
+ */
+static int SkipInput(dPtr apDescriptor, const char* apData, int aSize)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  int Index;
+
+  if (time(0) >= pProtocol->SkipUntil) {
+    pProtocol->SkipUntil = 0;
+    return (0);
+  }
+
+  for (Index = 0; Index < aSize; ++Index) {
+    const char Letter = apData[Index];
+
+    if (Letter == (char)IAC)
+      pProtocol->SkipMatched = 1;
+    else if (pProtocol->SkipMatched == 1 && (Letter == (char)WILL || Letter == (char)WONT))
+      pProtocol->SkipMatched = 2;
+    else if (pProtocol->SkipMatched == 2 && Letter == (char)TELOPT_TM) {
+      pProtocol->SkipUntil = 0;
+      pProtocol->SkipMatched = 0;
+      return (Index + 1);
+    } else
+      pProtocol->SkipMatched = 0;
+  }
+
+  return (aSize);
+}
+
+/* Inflates the client's input and runs it through the parser.  Returns how
+ * much of the input it used, which is less than aSize if the client finished
+ * its stream part way through - the rest is plain text.
+ */
+static int InflateInput(dPtr apDescriptor, const char* apData, int aSize, char* apOut, int aOutSize,
+                        ssize_t* apCmdIndex)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  z_stream* pStream = pProtocol->pInflate;
+  char Buffer[MAX_INFLATE_BUFFER];
+  int Result;
+  int Used;
+
+  pStream->next_in = (Bytef*)apData;
+  pStream->avail_in = (uInt)aSize;
+
+  do {
+    pStream->next_out = (Bytef*)Buffer;
+    pStream->avail_out = sizeof(Buffer);
+    Result = inflate(pStream, Z_SYNC_FLUSH);
+
+    if (Result != Z_OK && Result != Z_STREAM_END && Result != Z_BUF_ERROR) {
+      /* There's no finding the end of a broken stream, so drop the lot */
+      ReportBug("MCCP3: The client sent a corrupt stream.\n");
+      InflateEnd(pProtocol);
+      pProtocol->bMCCP3 = false;
+      Queue(apDescriptor, WONT_MCCP3);
+      return (aSize);
+    }
+
+    /* Another stream can't start inside this one, so it all gets parsed */
+    if (ParseInput(apDescriptor, Buffer, sizeof(Buffer) - pStream->avail_out, apOut, aOutSize, apCmdIndex) < 0)
+      return (-1);
+  } while (Result == Z_OK && (pStream->avail_in > 0 || pStream->avail_out == 0));
+
+  Used = aSize - (int)pStream->avail_in;
+
+  if (Result == Z_STREAM_END) /* The client has gone back to plain text */
+    InflateEnd(pProtocol);
+
+  return (Used);
+}
+
+/******************************************************************************
+ Local negotiation functions.
+ ******************************************************************************/
+
+/* An optimistic connection that sends text without ever having sent a
+ * telnet command didn't understand the offers - it probably showed them as
+ * junk - so its host gets the careful negotiation next time.  One that just
+ * leaves proves nothing, as port scanners and quick disconnects do that too.
+ */
+static void NegotiateFallback(protocol_t* apProtocol)
+{
+  apProtocol->bOptimistic = false;
+
+  if (apProtocol->Host.empty() || !s_PlainHosts.insert(apProtocol->Host).second)
+    return;
+
+  s_PlainHostOrder.push_back(apProtocol->Host);
+  if (s_PlainHostOrder.size() > MAX_PLAIN_HOSTS) {
+    s_PlainHosts.erase(s_PlainHostOrder.front());
+    s_PlainHostOrder.pop_front();
+  }
+
+  do_log("Negotiation: %s doesn't speak telnet, negotiating carefully from now on.", apProtocol->Host.c_str());
+}
+
+/* Gives the user what their client had last time, if it's been seen before.
+ * Someone else behind the same address may have the same first TTYPE, so
+ * 256 colours and UTF-8 are left for this connection to confirm itself.
+ * Returns true if the TTYPE cycle should carry on in the background to do
+ * that, or because the entry is due to be checked - either way it's stored
+ * again when the cycle ends, correcting anything that's changed.
+ */
+static bool FingerprintApply(protocol_t* apProtocol)
+{
+  auto Found = s_FingerprintIndex.find(apProtocol->Fingerprint);
+  bool bVerify = false;
+
+  if (Found == s_FingerprintIndex.end())
+    return true;
+
+  client_fingerprint_t& Client = *Found->second;
+  if (++Client.Hits >= FINGERPRINT_VERIFY) {
+    Client.Hits = 0;
+    bVerify = true;
   }
-}
 
-/******************************************************************************
- UTF-8 global functions.
- ******************************************************************************/
+  apProtocol->Variables.ValueString[eOOB_CLIENT_ID] = Client.ClientID;
+  apProtocol->Variables.ValueString[eOOB_CLIENT_VERSION] = Client.ClientVersion;
+  apProtocol->Variables.ValueInt[eOOB_CLIENT_VERSION] = Client.MTTS;
+  apProtocol->Variables.ValueInt[eOOB_ANSI_COLORS] |= Client.ANSI;
+  if (Client.b256Support != eYES)
+    apProtocol->b256Support = Client.b256Support;
 
-char* UnicodeGet(int aValue)
-{
-  static char Buffer[8];
-  char* pString = Buffer;
+  s_Fingerprints.splice(s_Fingerprints.begin(), s_Fingerprints, Found->second);
 
-  UnicodeAdd(&pString, aValue);
-  *pString = '\0';
+  /* Only carry on if there's something this connection doesn't have yet */
+  if (bVerify || (Client.XTerm && !apProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS]) ||
+      (Client.UTF8 && !apProtocol->Variables.ValueInt[eOOB_UTF_8]))
+    return true;
 
-  return Buffer;
+  apProtocol->bFingerprinted = true;
+  return false;
 }
 
-void UnicodeAdd(char** apString, int aValue)
+/* Remembers what the TTYPE cycle (and CHARSET) found out about the client */
+static void FingerprintStore(protocol_t* apProtocol)
 {
-  if (aValue < 0x80) {
-    *(*apString)++ = (char)aValue;
-  } else if (aValue < 0x800) {
-    *(*apString)++ = (char)(0xC0 | (aValue >> 6));
-    *(*apString)++ = (char)(0x80 | (aValue & 0x3F));
-  } else if (aValue < 0x10000) {
-    *(*apString)++ = (char)(0xE0 | (aValue >> 12));
-    *(*apString)++ = (char)(0x80 | (aValue >> 6 & 0x3F));
-    *(*apString)++ = (char)(0x80 | (aValue & 0x3F));
-  } else if (aValue < 0x200000) {
-    *(*apString)++ = (char)(0xF0 | (aValue >> 18));
-    *(*apString)++ = (char)(0x80 | (aValue >> 12 & 0x3F));
-    *(*apString)++ = (char)(0x80 | (aValue >> 6 & 0x3F));
-    *(*apString)++ = (char)(0x80 | (aValue & 0x3F));
+  auto Found = s_FingerprintIndex.find(apProtocol->Fingerprint);
+  int Hits = 0;
+
+  if (apProtocol->Fingerprint.empty())
+    return;
+
+  if (Found != s_FingerprintIndex.end()) {
+    Hits = Found->second->Hits;
+    s_Fingerprints.erase(Found->second);
+  } else if (s_Fingerprints.size() >= MAX_FINGERPRINTS) {
+    s_FingerprintIndex.erase(s_Fingerprints.back().Key);
+    s_Fingerprints.pop_back();
   }
-}
 
-/******************************************************************************
- Local negotiation functions.
- ******************************************************************************/
+  s_Fingerprints.push_front({apProtocol->Fingerprint, Hits, apProtocol->Variables.ValueString[eOOB_CLIENT_ID],
+                             apProtocol->Variables.ValueString[eOOB_CLIENT_VERSION],
+                             apProtocol->Variables.ValueInt[eOOB_CLIENT_VERSION],
+                             apProtocol->Variables.ValueInt[eOOB_ANSI_COLORS],
+                             apProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS],
+                             apProtocol->Variables.ValueInt[eOOB_UTF_8], apProtocol->b256Support});
+  s_FingerprintIndex[apProtocol->Fingerprint] = s_Fingerprints.begin();
+  apProtocol->bFingerprinted = true;
+}
 
 static void Negotiate(dPtr apDescriptor)
 {
@@ -1584,14 +3151,15 @@ static void Negotiate(dPtr apDescriptor)
 
 #ifdef USING_MCCP
     const char WillMCCP[] = {(char)IAC, (char)WILL, TELOPT_MCCP, '\0'};
+    const char WillMCCP3[] = {(char)IAC, (char)WILL, TELOPT_MCCP3, '\0'};
 #endif // USING_MCCP
 
     /* Request the client type if TTYPE is supported. */
     if (pProtocol->bTTYPE)
-      Write(apDescriptor, RequestTTYPE);
+      Queue(apDescriptor, RequestTTYPE);
 
     /* Check for other protocols. */
-    Write(apDescriptor, DoNAWS);
+    Queue(apDescriptor, DoNAWS);
     /* Gnome-mud seems to have an issue with negotiating DoCHARSET under
      * certain conditions cause it to crash. This is a GNOME-MUD issue
      * and not an issue on our end. Never-the-less, if you discover you
@@ -1601,15 +3169,16 @@ static void Negotiate(dPtr apDescriptor)
      *
      * For more information on gnome-mud's bug see:
      * https://bugs.launchpad.net/ubuntu/+source/gnome-mud/+bug/398340 */
-    Write(apDescriptor, DoCHARSET);
-    Write(apDescriptor, WillMSDP);
-    Write(apDescriptor, WillMSSP);
-    Write(apDescriptor, WillMSP);
-    Write(apDescriptor, DoMXP);
-    Write(apDescriptor, WillGMCP);
+    Queue(apDescriptor, DoCHARSET);
+    Queue(apDescriptor, WillMSDP);
+    Queue(apDescriptor, WillMSSP);
+    Queue(apDescriptor, WillMSP);
+    Queue(apDescriptor, DoMXP);
+    Queue(apDescriptor, WillGMCP);
 
 #ifdef USING_MCCP
-    Write(apDescriptor, WillMCCP);
+    Queue(apDescriptor, WillMCCP);
+    Queue(apDescriptor, WillMCCP3);
 #endif // USING_MCCP
   }
 }
@@ -1627,6 +3196,11 @@ static void PerformHandshake(dPtr apDescriptor, char aCmd, char aProtocol)
         pProtocol->bNegotiated = true;
         pProtocol->bTTYPE = true;
         Negotiate(apDescriptor);
+      } else if (!pProtocol->bTTYPE) {
+        /* They've already been offered, so just ask for the client type */
+        const char RequestTTYPE[] = {(char)IAC, (char)SB, TELOPT_TTYPE, pSEND, (char)IAC, (char)SE, '\0'};
+        pProtocol->bTTYPE = true;
+        Queue(apDescriptor, RequestTTYPE);
       }
     } else if (aCmd == (char)WONT) {
       if (!pProtocol->bNegotiated) {
@@ -1655,7 +3229,7 @@ static void PerformHandshake(dPtr apDescriptor, char aCmd, char aProtocol)
     if (aCmd == (char)WILL) {
       char charset_utf8[] = {(char)IAC, (char)SB, TELOPT_CHARSET, 1,        ' ', 'U', 'T', 'F',
                              '-',       '8',      (char)IAC,      (char)SE, '\0'};
-      Write(apDescriptor, charset_utf8);
+      Queue(apDescriptor, charset_utf8);
       pProtocol->bCHARSET = true;
     } else if (aCmd == (char)WONT)
       pProtocol->bCHARSET = false;
@@ -1686,16 +3260,29 @@ static void PerformHandshake(dPtr apDescriptor, char aCmd, char aProtocol)
 
   case (char)TELOPT_MCCP:
     if (aCmd == (char)DO) {
-      pProtocol->bMCCP = true;
-      CompressStart(apDescriptor);
+      if (!pProtocol->bMCCP) {
+        pProtocol->bMCCP = true;
+        CompressStart(apDescriptor);
+      }
     } else if (aCmd == (char)DONT) {
-      pProtocol->bMCCP = false;
-      CompressEnd(apDescriptor);
-      do_log("called CompressEnd from PerformHandshake");
+      if (pProtocol->bMCCP) {
+        pProtocol->bMCCP = false;
+        CompressEnd(apDescriptor);
+      }
     } else // Anything else is invalid.
       bResult = false;
     break;
 
+  case (char)TELOPT_MCCP3:
+    /* An inflate stream that's already running ends when the client ends it */
+    if (aCmd == (char)DO)
+      pProtocol->bMCCP3 = true;
+    else if (aCmd == (char)DONT)
+      pProtocol->bMCCP3 = false;
+    else // Anything else is invalid.
+      bResult = false;
+    break;
+
   case (char)TELOPT_MSP:
     if (aCmd == (char)DO)
       pProtocol->bMSP = true;
@@ -1709,12 +3296,12 @@ static void PerformHandshake(dPtr apDescriptor, char aCmd, char aProtocol)
     if (aCmd == (char)WILL || aCmd == (char)DO) {
       /* Enable MXP. */
       const char EnableMXP[] = {(char)IAC, (char)SB, TELOPT_MXP, (char)IAC, (char)SE, '\0'};
-      Write(apDescriptor, EnableMXP);
+      Queue(apDescriptor, EnableMXP);
 
       /* Create a secure channel, and note that MXP is active. */
       Write(apDescriptor, "\033[7z");
       pProtocol->bMXP = true;
-      pProtocol->pVariables[eOOB_MXP]->ValueInt = 1;
+      pProtocol->Variables.ValueInt[eOOB_MXP] = 1;
     } else if (aCmd == (char)WONT) {
       if (!pProtocol->bMXP) {
         /* The MXP standard doesn't actually specify whether you should
@@ -1725,7 +3312,7 @@ static void PerformHandshake(dPtr apDescriptor, char aCmd, char aProtocol)
          * with WONT, we try again (here) with IAC WILL MXP.
          */
         const char WillMXP[] = {(char)IAC, (char)WILL, TELOPT_MXP, '\0'};
-        Write(apDescriptor, WillMXP);
+        Queue(apDescriptor, WillMXP);
       } else // The client is actually asking us to switch MXP off.
       {
         pProtocol->bMXP = false;
@@ -1739,10 +3326,11 @@ static void PerformHandshake(dPtr apDescriptor, char aCmd, char aProtocol)
   case (char)TELOPT_GMCP:
     if (aCmd == (char)DO) {
       pProtocol->bGMCP = true;
+      OOBMarkDirty(apDescriptor, 0);
 
 #ifdef MUDLET_PACKAGE
       /* Send the Mudlet GUI package to the user. */
-      if (MatchString("Mudlet", pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString)) {
+      if (MatchString("Mudlet", pProtocol->Variables.ValueString[eOOB_CLIENT_ID].c_str())) {
         SendGMCP(apDescriptor, "Client.GUI", MUDLET_PACKAGE);
         json clientMap;
         clientMap["url"] = "https://www.worldofpa.in/maps/map.xml";
@@ -1772,22 +3360,23 @@ static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, in
   switch (aCmd) {
   case (char)TELOPT_TTYPE:
     if (pProtocol->bTTYPE) {
+      const char RequestTTYPE[] = {(char)IAC, (char)SB, TELOPT_TTYPE, pSEND, (char)IAC, (char)SE, '\0'};
       /* Store the client name. */
-      const int MaxClientLength = 64;
-      char* pClientName = (char*)alloca(MaxClientLength + 1);
+      char pClientName[MAX_CLIENT_NAME + 1];
       int i = 0, j = 1;
       bool bStopCyclicTTYPE = false;
+      bool bRequested = false;
+      bool bCached = false;
 
-      for (; apData[j] != '\0' && i < MaxClientLength; ++j) {
+      for (; apData[j] != '\0' && i < MAX_CLIENT_NAME; ++j) {
         if (isprint(apData[j]))
           pClientName[i++] = apData[j];
       }
       pClientName[i] = '\0';
 
       /* Store the first TTYPE as the client name */
-      if (!strcmp(pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString, "Unknown")) {
-        free(pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString);
-        pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString = AllocString(pClientName);
+      if (pProtocol->Variables.ValueString[eOOB_CLIENT_ID] == "Unknown") {
+        pProtocol->Variables.ValueString[eOOB_CLIENT_ID] = pClientName;
 
         /* This is a bit nasty, but using cyclic TTYPE on windows telnet
          * causes it to lock up.  None of the clients we need to cycle
@@ -1805,6 +3394,16 @@ static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, in
          */
         if (!strcmp(pClientName, "ANSI"))
           bStopCyclicTTYPE = true;
+
+        /* If this client has connected from here before, we know the rest.
+         * Windows telnet is never remembered, as checking it again later
+         * would mean asking for another TTYPE.
+         */
+        if (!bStopCyclicTTYPE) {
+          pProtocol->Fingerprint = pProtocol->Host + '\n' + pClientName;
+          if (s_FingerprintIndex.count(pProtocol->Fingerprint) != 0)
+            bCached = bStopCyclicTTYPE = true;
+        }
       }
 
       /* Cycle through the TTYPEs until we get the same result twice, or
@@ -1817,8 +3416,7 @@ static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, in
        */
       if (pProtocol->pLastTTYPE == NULL
           || (strcmp(pProtocol->pLastTTYPE, pClientName)
-              && strcmp(pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString, pClientName))) {
-        char RequestTTYPE[] = {(char)IAC, (char)SB, TELOPT_TTYPE, pSEND, (char)IAC, (char)SE, '\0'};
+              && pProtocol->Variables.ValueString[eOOB_CLIENT_ID] != pClientName)) {
         const char* pStartPos = strstr(pClientName, "-");
 
         /* Store the TTYPE */
@@ -1831,26 +3429,28 @@ static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, in
           /* This is currently the only way to detect support for 256
            * colours in TinTin++, WinTin++ and BlowTorch.
            */
-          pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
+          pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
           pProtocol->b256Support = eYES;
         }
 
         /* Request another TTYPE */
-        if (!bStopCyclicTTYPE)
-          Write(apDescriptor, RequestTTYPE);
+        if (!bStopCyclicTTYPE) {
+          Queue(apDescriptor, RequestTTYPE);
+          bRequested = true;
+        }
       }
 
       if (PrefixString("MTTS ", pClientName)) {
-        pProtocol->pVariables[eOOB_CLIENT_VERSION]->ValueInt = atoi(pClientName + 5);
+        pProtocol->Variables.ValueInt[eOOB_CLIENT_VERSION] = atoi(pClientName + 5);
 
-        if (pProtocol->pVariables[eOOB_CLIENT_VERSION]->ValueInt & 1) {
-          pProtocol->pVariables[eOOB_ANSI_COLORS]->ValueInt = 1;
+        if (pProtocol->Variables.ValueInt[eOOB_CLIENT_VERSION] & 1) {
+          pProtocol->Variables.ValueInt[eOOB_ANSI_COLORS] = 1;
         }
-        if (pProtocol->pVariables[eOOB_CLIENT_VERSION]->ValueInt & 4) {
-          pProtocol->pVariables[eOOB_UTF_8]->ValueInt = 1;
+        if (pProtocol->Variables.ValueInt[eOOB_CLIENT_VERSION] & 4) {
+          pProtocol->Variables.ValueInt[eOOB_UTF_8] = 1;
         }
-        if (pProtocol->pVariables[eOOB_CLIENT_VERSION]->ValueInt & 8) {
-          pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
+        if (pProtocol->Variables.ValueInt[eOOB_CLIENT_VERSION] & 8) {
+          pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
           pProtocol->b256Support = eYES;
         }
       } else if (PrefixString("Mudlet", pClientName)) {
@@ -1862,32 +3462,28 @@ static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, in
 
         if (strlen(pClientName) > 7) {
           pClientName[6] = '\0';
-          free(pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString);
-          pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString = AllocString(pClientName);
-          free(pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString);
-          pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString = AllocString(pClientName + 7);
+          pProtocol->Variables.ValueString[eOOB_CLIENT_ID] = pClientName;
+          pProtocol->Variables.ValueString[eOOB_CLIENT_VERSION] = pClientName + 7;
 
           /* Mudlet 1.1 and later supports 256 colours. */
-          if (strcmp(pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString, "1.1") >= 0) {
-            pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
+          if (pProtocol->Variables.ValueString[eOOB_CLIENT_VERSION] >= "1.1") {
+            pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
             pProtocol->b256Support = eYES;
           }
         }
       } else if (MatchString(pClientName, "EMACS-RINZAI")) {
         /* We know for certain that this client has support */
-        pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
+        pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
         pProtocol->b256Support = eYES;
       } else if (PrefixString("DecafMUD", pClientName)) {
         /* We know for certain that this client has support */
-        pProtocol->pVariables[eOOB_XTERM_256_COLORS]->ValueInt = 1;
+        pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
         pProtocol->b256Support = eYES;
 
         if (strlen(pClientName) > 9) {
           pClientName[8] = '\0';
-          free(pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString);
-          pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString = AllocString(pClientName);
-          free(pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString);
-          pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString = AllocString(pClientName + 9);
+          pProtocol->Variables.ValueString[eOOB_CLIENT_ID] = pClientName;
+          pProtocol->Variables.ValueString[eOOB_CLIENT_VERSION] = pClientName + 9;
         }
       } else if (MatchString(pClientName, "MUSHCLIENT") || MatchString(pClientName, "CMUD")
                  || MatchString(pClientName, "ATLANTIS") || MatchString(pClientName, "KILDCLIENT")
@@ -1898,6 +3494,15 @@ static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, in
         /* We know for certain that this client does not have support */
         pProtocol->b256Support = eNO;
       }
+
+      /* Either use what we found out last time, or remember what we've
+       * found out this time once the cycle is over.
+       */
+      if (bCached && FingerprintApply(pProtocol)) {
+        Queue(apDescriptor, RequestTTYPE);
+      } else if (!bRequested && !pProtocol->bFingerprinted) {
+        FingerprintStore(pProtocol);
+      }
     }
     break;
 
@@ -1922,8 +3527,13 @@ static void PerformSubnegotiation(dPtr apDescriptor, char aCmd, char* apData, in
        *
        * Note that the user must also use a unicode font!
        */
-      if (apData[0] == pACCEPTED)
-        pProtocol->pVariables[eOOB_UTF_8]->ValueInt = 1;
+      if (apData[0] == pACCEPTED) {
+        pProtocol->Variables.ValueInt[eOOB_UTF_8] = 1;
+
+        /* It may have come after the TTYPE cycle, so remember it as well */
+        if (pProtocol->bFingerprinted)
+          FingerprintStore(pProtocol);
+      }
     }
     break;
 
@@ -1970,79 +3580,89 @@ static void ParseOOB(dPtr apDescriptor, const char* apData)
   }
 }
 
+/* Returns the response to one of the LIST requests that's the same for
+ * everyone.  The variable table can't change while the mud is running, so
+ * each is only encoded once.
+ */
+static const gmcp_payload_t& OOBListPayload(oob_list_t aList, bool abGMCP)
+{
+  gmcp_payload_t& pPayload = s_pOOBLists[aList][abGMCP];
+  string Value;
+  int i; /* Loop counter */
+
+  if (pPayload)
+    return pPayload;
+
+  switch (aList) {
+  case eLIST_COMMANDS:
+    Value = "LIST REPORT RESET SEND UNREPORT";
+    break;
+  case eLIST_LISTS:
+    Value = "COMMANDS LISTS CONFIGURABLE_VARIABLES REPORTABLE_VARIABLES "
+            "REPORTED_VARIABLES SENDABLE_VARIABLES GUI_VARIABLES";
+    break;
+  default:
+    for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
+      /* Split SENDABLE and REPORTABLE if some variables aren't REPORTABLE */
+      if ((aList == eLIST_CONFIGURABLE && VariableNameTable[i].bConfigurable)
+          || (aList == eLIST_GUI && VariableNameTable[i].bGUI)
+          || ((aList == eLIST_SENDABLE || aList == eLIST_REPORTABLE) && !VariableNameTable[i].bGUI)) {
+        /* Add the separator between variables */
+        if (!Value.empty())
+          Value += ' ';
+
+        /* Add the variable to the list */
+        Value += VariableNameTable[i].pName;
+      }
+    }
+    break;
+  }
+
+  string Frame;
+  FrameList(Frame, abGMCP, s_OOBListNames[aList], Value.c_str());
+  pPayload = make_shared<const string>(std::move(Frame));
+  return pPayload;
+}
+
 static void ExecuteOOBPair(dPtr apDescriptor, const char* apVariable, const char* apValue)
 {
   if (apVariable[0] != '\0' && apValue[0] != '\0') {
     if (MatchString(apVariable, "SEND")) {
-      bool bDone = false;
-      int i; /* Loop counter */
-      for (i = eOOB_NONE + 1; i < eOOB_MAX && !bDone; ++i) {
-        if (MatchString(apValue, VariableNameTable[i].pName)) {
-          OOBSend(apDescriptor, (variable_t)i);
-          bDone = true;
-        }
-      }
+      variable_t Variable = LookupVariable(apValue);
+      if (Variable != eOOB_NONE)
+        OOBSend(apDescriptor, Variable);
     } else if (MatchString(apVariable, "REPORT")) {
-      bool bDone = false;
-      int i; /* Loop counter */
-      for (i = eOOB_NONE + 1; i < eOOB_MAX && !bDone; ++i) {
-        if (MatchString(apValue, VariableNameTable[i].pName)) {
-          apDescriptor->pProtocol->pVariables[i]->bReport = true;
-          apDescriptor->pProtocol->pVariables[i]->bDirty = true;
-          bDone = true;
-        }
+      variable_t Variable = LookupVariable(apValue);
+      if (Variable != eOOB_NONE) {
+        apDescriptor->pProtocol->Variables.Report |= OOB_BIT(Variable);
+        OOBMarkDirty(apDescriptor, OOB_BIT(Variable));
       }
     } else if (MatchString(apVariable, "RESET")) {
       if (MatchString(apValue, "REPORTABLE_VARIABLES") || MatchString(apValue, "REPORTED_VARIABLES")) {
         int i; /* Loop counter */
         for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-          if (apDescriptor->pProtocol->pVariables[i]->bReport) {
-            apDescriptor->pProtocol->pVariables[i]->bReport = false;
-            apDescriptor->pProtocol->pVariables[i]->bDirty = false;
+          if (apDescriptor->pProtocol->Variables.Report & OOB_BIT(i)) {
+            apDescriptor->pProtocol->Variables.Report &= ~OOB_BIT(i);
+            apDescriptor->pProtocol->Variables.Dirty &= ~OOB_BIT(i);
           }
         }
       }
     } else if (MatchString(apVariable, "UNREPORT")) {
-      bool bDone = false;
-      int i; /* Loop counter */
-      for (i = eOOB_NONE + 1; i < eOOB_MAX && !bDone; ++i) {
-        if (MatchString(apValue, VariableNameTable[i].pName)) {
-          apDescriptor->pProtocol->pVariables[i]->bReport = false;
-          apDescriptor->pProtocol->pVariables[i]->bDirty = false;
-          bDone = true;
-        }
+      variable_t Variable = LookupVariable(apValue);
+      if (Variable != eOOB_NONE) {
+        apDescriptor->pProtocol->Variables.Report &= ~OOB_BIT(Variable);
+        apDescriptor->pProtocol->Variables.Dirty &= ~OOB_BIT(Variable);
       }
     } else if (MatchString(apVariable, "LIST")) {
-      if (MatchString(apValue, "COMMANDS")) {
-        const char MSDPCommands[] = "LIST REPORT RESET SEND UNREPORT";
-        OOBSendList(apDescriptor, "COMMANDS", MSDPCommands);
-      } else if (MatchString(apValue, "LISTS")) {
-        const char MSDPCommands[] = "COMMANDS LISTS CONFIGURABLE_VARIABLES REPORTABLE_VARIABLES "
-                                    "REPORTED_VARIABLES SENDABLE_VARIABLES GUI_VARIABLES";
-        OOBSendList(apDescriptor, "LISTS", MSDPCommands);
-      }
-      /* Split this into two if some variables aren't REPORTABLE */
-      else if (MatchString(apValue, "SENDABLE_VARIABLES") || MatchString(apValue, "REPORTABLE_VARIABLES")) {
-        char MSDPCommands[MAX_OUTPUT_BUFFER] = {'\0'};
-        int i; /* Loop counter */
-
-        for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-          if (!VariableNameTable[i].bGUI) {
-            /* Add the separator between variables */
-            strcat(MSDPCommands, " ");
-
-            /* Add the variable to the list */
-            strcat(MSDPCommands, VariableNameTable[i].pName);
-          }
-        }
+      int List; /* Loop counter */
 
-        OOBSendList(apDescriptor, apValue, MSDPCommands);
-      } else if (MatchString(apValue, "REPORTED_VARIABLES")) {
+      /* Only this one differs between players */
+      if (MatchString(apValue, "REPORTED_VARIABLES")) {
         char MSDPCommands[MAX_OUTPUT_BUFFER] = {'\0'};
         int i; /* Loop counter */
 
         for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-          if (apDescriptor->pProtocol->pVariables[i]->bReport) {
+          if (apDescriptor->pProtocol->Variables.Report & OOB_BIT(i)) {
             /* Add the separator between variables */
             if (MSDPCommands[0] != '\0')
               strcat(MSDPCommands, " ");
@@ -2053,83 +3673,53 @@ static void ExecuteOOBPair(dPtr apDescriptor, const char* apVariable, const char
         }
 
         OOBSendList(apDescriptor, apValue, MSDPCommands);
-      } else if (MatchString(apValue, "CONFIGURABLE_VARIABLES")) {
-        char MSDPCommands[MAX_OUTPUT_BUFFER] = {'\0'};
-        int i; /* Loop counter */
-
-        for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-          if (VariableNameTable[i].bConfigurable) {
-            /* Add the separator between variables */
-            if (MSDPCommands[0] != '\0')
-              strcat(MSDPCommands, " ");
-
-            /* Add the variable to the list */
-            strcat(MSDPCommands, VariableNameTable[i].pName);
-          }
-        }
-
-        OOBSendList(apDescriptor, "CONFIGURABLE_VARIABLES", MSDPCommands);
-      } else if (MatchString(apValue, "GUI_VARIABLES")) {
-        char MSDPCommands[MAX_OUTPUT_BUFFER] = {'\0'};
-        int i; /* Loop counter */
-
-        for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-          if (VariableNameTable[i].bGUI) {
-            /* Add the separator between variables */
-            if (MSDPCommands[0] != '\0')
-              strcat(MSDPCommands, " ");
-
-            /* Add the variable to the list */
-            strcat(MSDPCommands, VariableNameTable[i].pName);
+      } else if (apDescriptor->pProtocol->bGMCP || apDescriptor->pProtocol->bMSDP) {
+        for (List = 0; List < eLIST_MAX; ++List) {
+          if (MatchString(apValue, s_OOBListNames[List])) {
+            QueueShared(apDescriptor, OOBListPayload((oob_list_t)List, apDescriptor->pProtocol->bGMCP));
+            break;
           }
         }
-
-        OOBSendList(apDescriptor, apValue, MSDPCommands);
       }
     } else /* Set any configurable variables */
     {
-      int i; /* Loop counter */
-
-      for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
-        if (VariableNameTable[i].bConfigurable) {
-          if (MatchString(apVariable, VariableNameTable[i].pName)) {
-            if (VariableNameTable[i].bString) {
-              /* A write-once variable can only be set if the value
-               * is "Unknown".  This is for things like client name,
-               * where we don't really want the player overwriting a
-               * proper client name with junk - but on the other hand,
-               * its possible a client may choose to use MSDP to
-               * identify itself.
-               */
-              if (!VariableNameTable[i].bWriteOnce
-                  || !strcmp(apDescriptor->pProtocol->pVariables[i]->pValueString, "Unknown")) {
-                /* Store the new value if it's valid */
-                char* pBuffer = (char*)alloca(VariableNameTable[i].Max + 1);
-                int j; /* Loop counter */
-
-                for (j = 0; j < VariableNameTable[i].Max && *apValue != '\0'; ++apValue) {
-                  if (isprint(*apValue))
-                    pBuffer[j++] = *apValue;
-                }
-                pBuffer[j++] = '\0';
-
-                if (j >= VariableNameTable[i].Min) {
-                  free(apDescriptor->pProtocol->pVariables[i]->pValueString);
-                  apDescriptor->pProtocol->pVariables[i]->pValueString = AllocString(pBuffer);
-                }
-              }
-            } else /* This variable only accepts numeric values */
-            {
-              /* Strip any leading spaces */
-              while (*apValue == ' ')
-                ++apValue;
-
-              if (*apValue != '\0' && IsNumber(apValue)) {
-                int Value = atoi(apValue);
-                if (Value >= VariableNameTable[i].Min && Value <= VariableNameTable[i].Max) {
-                  apDescriptor->pProtocol->pVariables[i]->ValueInt = Value;
-                }
-              }
+      variable_t i = LookupVariable(apVariable);
+
+      if (i != eOOB_NONE && VariableNameTable[i].bConfigurable) {
+        if (VariableNameTable[i].bString) {
+          /* A write-once variable can only be set if the value
+           * is "Unknown".  This is for things like client name,
+           * where we don't really want the player overwriting a
+           * proper client name with junk - but on the other hand,
+           * its possible a client may choose to use MSDP to
+           * identify itself.
+           */
+          if (!VariableNameTable[i].bWriteOnce
+              || apDescriptor->pProtocol->Variables.ValueString[i] == "Unknown") {
+            /* Store the new value if it's valid */
+            char* pBuffer = (char*)alloca(VariableNameTable[i].Max + 1);
+            int j; /* Loop counter */
+
+            for (j = 0; j < VariableNameTable[i].Max && *apValue != '\0'; ++apValue) {
+              if (isprint(*apValue))
+                pBuffer[j++] = *apValue;
+            }
+            pBuffer[j++] = '\0';
+
+            if (j >= VariableNameTable[i].Min) {
+              apDescriptor->pProtocol->Variables.ValueString[i] = pBuffer;
+            }
+          }
+        } else /* This variable only accepts numeric values */
+        {
+          /* Strip any leading spaces */
+          while (*apValue == ' ')
+            ++apValue;
+
+          if (*apValue != '\0' && IsNumber(apValue)) {
+            int Value = atoi(apValue);
+            if (Value >= VariableNameTable[i].Min && Value <= VariableNameTable[i].Max) {
+              apDescriptor->pProtocol->Variables.ValueInt[i] = Value;
             }
           }
         }
@@ -2138,197 +3728,485 @@ static void ExecuteOOBPair(dPtr apDescriptor, const char* apVariable, const char
   }
 }
 
+static void OOBInit(void)
+{
+  vector<const char*> Names;
+  int i, j; /* Loop counters */
+
+  for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i)
+    Names.push_back(VariableNameTable[i].pName);
+  s_VariableSeed = PerfectHash(Names, s_VariableSlots);
+
+  for (i = eOOB_NONE + 1; i < eOOB_MAX; ++i) {
+    s_OOBCategoryMask[i] = 0;
+    for (j = eOOB_NONE + 1; j < eOOB_MAX; ++j) {
+      if (VariableNameTable[j].pCategory == VariableNameTable[i].pCategory)
+        s_OOBCategoryMask[i] |= OOB_BIT(j);
+    }
+
+    /* IAC SB GMCP Category { */
+    FrameStart(s_GMCPHeader[i], (char)TELOPT_GMCP);
+    FrameAppend(s_GMCPHeader[i], VariableNameTable[i].pCategory);
+    s_GMCPHeader[i] += " {";
+
+    JSONAppendString(s_GMCPKey[i], VariableNameTable[i].pKey);
+    s_GMCPKey[i] += ':';
+  }
+}
+
+/* MSDP variable names aren't case sensitive */
+static variable_t LookupVariable(string_view aName)
+{
+  int Slot;
+
+  if (s_VariableSlots.empty())
+    return eOOB_NONE;
+
+  Slot = s_VariableSlots[HashName(aName, s_VariableSeed) & (s_VariableSlots.size() - 1)];
+  if (Slot != -1 && MatchString(aName, VariableNameTable[Slot].pName))
+    return (variable_t)Slot;
+
+  return eOOB_NONE;
+}
+
+/* The dirty variables OOBUpdate() would send - all of them for GMCP, but only
+ * the reported ones for MSDP.
+ */
+static oob_mask_t OOBPending(protocol_t* apProtocol)
+{
+  oob_mask_t Pending = apProtocol->Variables.Dirty;
+
+  if (!apProtocol->bGMCP)
+    Pending &= apProtocol->Variables.Report;
+
+  return Pending;
+}
+
+/* Marks the variables dirty, and queues the descriptor for OOBUpdateAll() if
+ * that leaves it with anything to send.  A mask of 0 just does the queueing.
+ */
+static void OOBMarkDirty(dPtr apDescriptor, oob_mask_t aMask)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+
+  pProtocol->Variables.Dirty |= aMask;
+
+  if (!pProtocol->bQueuedOOB && OOBPending(pProtocol) != 0) {
+    pProtocol->bQueuedOOB = true;
+    s_DirtyOOB.push_back(apDescriptor);
+  }
+}
+
+/* Appends one GMCP message per category with pending variables, each holding
+ * just those variables, in table order.  Nothing here allocates once the
+ * result has grown to fit.
+ */
+static void OOBWriteGMCP(protocol_t* apProtocol, oob_mask_t aPending, string& aResult)
+{
+  while (aPending != 0) {
+    int First = __builtin_ctzll(aPending);
+    oob_mask_t Category = aPending & s_OOBCategoryMask[First];
+    const char* pSeparator = "";
+
+    aPending &= ~Category;
+    aResult += s_GMCPHeader[First];
+
+    while (Category != 0) {
+      int i = __builtin_ctzll(Category);
+      Category &= Category - 1;
+
+      aResult += pSeparator;
+      aResult += s_GMCPKey[i];
+      if (VariableNameTable[i].bString) {
+        JSONAppendString(aResult, apProtocol->Variables.ValueString[i]);
+      } else {
+        FrameAppendNumber(aResult, apProtocol->Variables.ValueInt[i]);
+      }
+      pSeparator = ",";
+    }
+
+    aResult += '}';
+    FrameEnd(aResult);
+  }
+}
+
 /******************************************************************************
  Local GMCP functions.
  ******************************************************************************/
 
 static void ParseGMCP(dPtr apDescriptor, const char* apData)
 {
-  char *pPos = NULL, *pStart = NULL;
-  char cMessage[MAX_INPUT_LENGTH];
-  char cPayload[MAX_INPUT_LENGTH];
-  bool payload = false;
-  json response, jPayload;
-  string Message, Payload;
-
-  // start writing to cMessage from apData
-  pPos = pStart = cMessage;
-  while (*apData) {
-    // write to cMessage until we hit a space
-    if (*apData == ' ') {
-      if (!payload) { // now write to cPayload
-        pPos = pStart = cPayload;
-        apData++;                         // skip the space
-        if (*apData && *apData != '\0') { // if there is something after the
-                                          // space, we have a payload
-          payload = true;
-          continue;
-        }
-      }
-    }
-    *pPos++ = *apData++;
-    *pPos = '\0';
+  string_view Message = apData;
+  string_view Payload;
+
+  /* The package name runs up to the first space, and the payload after it */
+  size_t Space = Message.find(' ');
+  if (Space != string_view::npos) {
+    Payload = Message.substr(Space + 1);
+    Message = Message.substr(0, Space);
   }
 
-  // transfer C string to C++ Message string
-  Message = cMessage;
-  // GMCP messages are not case sensitive so we make them all lower case
-  transform(Message.begin(), Message.end(), Message.begin(), ::tolower);
+  if (s_GMCPSlots.empty())
+    GMCPBuildHash();
+
+  /* The hash is perfect, so there's only ever one name to check */
+  int Slot = s_GMCPSlots[HashName(Message, s_GMCPSeed) & (s_GMCPSlots.size() - 1)];
+  if (Slot != -1 && MatchString(Message, s_GMCPPackages[Slot].pName))
+    s_GMCPPackages[Slot].Handler(apDescriptor, Payload);
+}
+
+static bool GMCPParsePayload(string_view aPayload, gmcp_sax_t& aHandler)
+{
+  if (aPayload.empty())
+    return false;
+
+  return json::sax_parse(aPayload.begin(), aPayload.end(), &aHandler);
+}
 
-  // terminate C string and copy to C++ Payload string
-  if (!payload)
-    cPayload[0] = '\0';
-  Payload = cPayload;
+static void GMCPBuildHash(void)
+{
+  vector<const char*> Names;
 
-  // Handle GMCP Messages that don't require payloads
+  for (const gmcp_package_t& Package : s_GMCPPackages)
+    Names.push_back(Package.pName);
 
-  if (Message == "external.discord.hello") {
-    response["inviteurl"] = "https://discord.gg/8gNA9jR57r";
-    response["applicationid"] = "<YOUR APPLICATION ID>";
-    SendGMCPJ(apDescriptor, "External.Discord.Info", response.dump());
-    response.clear();
+  s_GMCPSeed = PerfectHash(Names, s_GMCPSlots);
+}
 
-    response["details"] = "https://www.worldofpa.in";
-    response["game"] = "World of Pain";
-    response["starttime"] = std::time(nullptr);
-    SendGMCPJ(apDescriptor, "External.Discord.Status", response.dump());
-    return;
+/* Core.Hello { "client": "Mudlet", "version": "4.17.2" } */
+struct core_hello_sax_t : gmcp_sax_t
+{
+  protocol_t* pProtocol;
+  variable_t Key = eOOB_NONE; /* The variable the next value is for */
+
+  bool key(string_t& aKey) override
+  {
+    Key = eOOB_NONE;
+    if (Depth == 1 && aKey == "client")
+      Key = eOOB_CLIENT_ID;
+    else if (Depth == 1 && aKey == "version")
+      Key = eOOB_CLIENT_VERSION;
+    return true;
   }
 
-  if (Message == "external.discord.get") {
-    response["details"] = "https://www.worldofpa.in";
-    response["game"] = "World of Pain";
-    SendGMCPJ(apDescriptor, "External.Discord.Status", response.dump());
-    return;
+  bool string(string_t& aValue) override
+  {
+    if (Key != eOOB_NONE)
+      pProtocol->Variables.ValueString[Key] = std::move(aValue);
+    Key = eOOB_NONE;
+    return true;
   }
 
-  // Validate JSON payloads for messages that require them
-  if (payload) {
-    try {
-      jPayload = json::parse(Payload);
-    } catch (json::parse_error& e) {
-      do_log("JSON Parse Error: %s", e.what());
-      do_log("%s", Payload.c_str());
-    }
+  bool start_object(size_t aElements) override
+  {
+    Key = eOOB_NONE;
+    return gmcp_sax_t::start_object(aElements);
+  }
+
+  bool start_array(size_t aElements) override
+  {
+    Key = eOOB_NONE;
+    return gmcp_sax_t::start_array(aElements);
   }
+};
+
+static void GMCPCoreHello(dPtr apDescriptor, string_view aPayload)
+{
+  core_hello_sax_t Handler;
 
-  // handle Core.Hello and set client variables
-  if (Message == "core.hello" && jPayload.is_object()) {
-    if (jPayload["client"].is_string()) {
-      free(apDescriptor->pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString);
-      apDescriptor->pProtocol->pVariables[eOOB_CLIENT_ID]->pValueString =
-          AllocString(jPayload["client"].get<string>().c_str());
+  Handler.pProtocol = apDescriptor->pProtocol;
+  GMCPParsePayload(aPayload, Handler);
+}
+
+/* Core.Supports.Set [ "Char 1", "Room 1" ], only the names matter for Remove */
+struct core_supports_sax_t : gmcp_sax_t
+{
+  protocol_t* pProtocol;
+  bool bSet = false;    /* Core.Supports.Set replaces the whole list */
+  bool bRemove = false; /* Core.Supports.Remove takes modules off it */
+
+  /* Nothing changes until the whole payload has parsed */
+  vector<std::string> Modules;
+
+  bool string(string_t& aValue) override
+  {
+    if (Depth == 1) {
+      string_view Module = aValue;
+      string_view Version;
+
+      size_t Space = Module.find(' ');
+      if (Space != string_view::npos) {
+        Version = Module.substr(Space + 1);
+        Module = Module.substr(0, Space);
+      }
+
+      if (bRemove || Version == "1")
+        Modules.emplace_back(Module);
     }
-    if (jPayload["version"].is_string()) {
-      free(apDescriptor->pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString);
-      apDescriptor->pProtocol->pVariables[eOOB_CLIENT_VERSION]->pValueString =
-          AllocString(jPayload["version"].get<string>().c_str());
+    return true;
+  }
+
+  void apply(void)
+  {
+    if (bSet) {
+      pProtocol->GMCPModules = 0;
+      pProtocol->GMCPSupports.clear();
     }
+
+    for (const std::string& Module : Modules)
+      GMCPSetSupport(pProtocol, Module, !bRemove);
   }
+};
+
+static void GMCPCoreSupportsSet(dPtr apDescriptor, string_view aPayload)
+{
+  core_supports_sax_t Handler;
 
-  // handle Core.Supports.Set, Add and Remove
-  string mode = GMCPMessageMode("core.supports.", Message);
-  if (!mode.empty() && jPayload.is_array()) {
-    if (mode == "set" && !apDescriptor->pProtocol->GMCPSupports.empty())
-      apDescriptor->pProtocol->GMCPSupports.clear();
+  Handler.pProtocol = apDescriptor->pProtocol;
+  Handler.bSet = true;
+  if (GMCPParsePayload(aPayload, Handler))
+    Handler.apply();
+}
 
-    vector<string> CoreSupports = jPayload;
+static void GMCPCoreSupportsAdd(dPtr apDescriptor, string_view aPayload)
+{
+  core_supports_sax_t Handler;
 
-    for (auto supports : CoreSupports) {
-      if (mode == "remove") {
-        apDescriptor->pProtocol->GMCPSupports.erase(supports);
-      } else if (mode == "set" || mode == "add") {
-        auto pos = supports.find(" ");
-        string val = supports.substr(pos + 1);
-        string key = supports.substr(0, pos);
-        if (val == "1")
-          apDescriptor->pProtocol->GMCPSupports.emplace(key);
-      } else {
-        do_log("GMCP Core.Supports unknown mode: %s", mode.c_str());
-      }
+  Handler.pProtocol = apDescriptor->pProtocol;
+  if (GMCPParsePayload(aPayload, Handler))
+    Handler.apply();
+}
+
+static void GMCPCoreSupportsRemove(dPtr apDescriptor, string_view aPayload)
+{
+  core_supports_sax_t Handler;
+
+  Handler.pProtocol = apDescriptor->pProtocol;
+  Handler.bRemove = true;
+  if (GMCPParsePayload(aPayload, Handler))
+    Handler.apply();
+}
+
+static void GMCPDiscordHello(dPtr apDescriptor, string_view aPayload)
+{
+  json response;
+
+  response["inviteurl"] = "https://discord.gg/8gNA9jR57r";
+  response["applicationid"] = "<YOUR APPLICATION ID>";
+  SendGMCPJ(apDescriptor, "External.Discord.Info", response.dump());
+  response.clear();
+
+  response["details"] = "https://www.worldofpa.in";
+  response["game"] = "World of Pain";
+  response["starttime"] = std::time(nullptr);
+  SendGMCPJ(apDescriptor, "External.Discord.Status", response.dump());
+}
+
+static void GMCPDiscordGet(dPtr apDescriptor, string_view aPayload)
+{
+  /* It never changes, so it's only encoded once */
+  static gmcp_payload_t s_pDiscordStatus;
+  if (!s_pDiscordStatus) {
+    json response;
+    response["details"] = "https://www.worldofpa.in";
+    response["game"] = "World of Pain";
+    s_pDiscordStatus = GMCPEncode("External.Discord.Status", response.dump());
+  }
+  GMCPSendPayload(apDescriptor, s_pDiscordStatus);
+}
+
+void GMCPRegister(const char* apPackage, gmcp_handler_t aHandler)
+{
+  if (apPackage == NULL || aHandler == NULL)
+    return;
+
+  for (gmcp_package_t& Package : s_GMCPPackages) {
+    if (MatchString(apPackage, Package.pName)) {
+      Package.Handler = aHandler;
+      return;
     }
   }
+
+  s_GMCPPackages.push_back({apPackage, aHandler});
+  GMCPBuildHash();
+}
+
+// Does the client support the GMCP module?
+bool GMCPSupports(dPtr d, gmcp_module_t aModule)
+{
+  if (!d || d->close_me)
+    return false;
+  return (d->pProtocol->bGMCP && (d->pProtocol->GMCPModules & GMCP_BIT(aModule)));
+}
+
+bool GMCPSupports(dPtr d, const char* module)
+{
+  gmcp_module_t Module = GMCPModuleLookup(module);
+
+  if (Module != eGMCP_NONE)
+    return GMCPSupports(d, Module);
+  if (!d || d->close_me || !d->pProtocol->bGMCP || d->pProtocol->GMCPSupports.empty())
+    return false;
+  return d->pProtocol->GMCPSupports.count(GMCPModuleKey(module)) != 0;
+}
+
+static void GMCPModuleInit(void)
+{
+  vector<const char*> Names(s_GMCPModuleNames, s_GMCPModuleNames + eGMCP_MAX);
+
+  s_GMCPModuleSeed = PerfectHash(Names, s_GMCPModuleSlots);
+}
+
+/* GMCP module names aren't case sensitive */
+static gmcp_module_t GMCPModuleLookup(string_view aName)
+{
+  int Slot;
+
+  if (s_GMCPModuleSlots.empty())
+    return eGMCP_NONE;
+
+  Slot = s_GMCPModuleSlots[HashName(aName, s_GMCPModuleSeed) & (s_GMCPModuleSlots.size() - 1)];
+  if (Slot != -1 && MatchString(aName, s_GMCPModuleNames[Slot]))
+    return (gmcp_module_t)Slot;
+
+  return eGMCP_NONE;
 }
 
-// utility function to return the part after key, if key exists in Message
-// example: core.supports. key in Message core.supports.set returns set
-string GMCPMessageMode(string key, string Message)
+/* Modules we don't know are kept in lower case, so they aren't case
+ * sensitive either.
+ */
+static string GMCPModuleKey(string_view aName)
 {
-  auto mPos = Message.find(key);
-  if (mPos == string::npos)
-    return "";
-  else
-    return Message.substr(mPos + key.length());
+  string Key(aName);
+
+  for (char& c : Key)
+    c = tolower(c);
+
+  return Key;
 }
 
-// Does the client support the GMCP module?
-bool GMCPSupports(dPtr d, const char* module)
+/* Known modules are kept as bits, anything else goes in the set */
+static void GMCPSetSupport(protocol_t* apProtocol, string_view aModule, bool abSupported)
 {
-  if (!d || d->close_me)
-    return false;
-  return (d->pProtocol->bGMCP && d->pProtocol->GMCPSupports.find(module) != d->pProtocol->GMCPSupports.end());
+  gmcp_module_t Module = GMCPModuleLookup(aModule);
+
+  if (Module != eGMCP_NONE) {
+    if (abSupported)
+      apProtocol->GMCPModules |= GMCP_BIT(Module);
+    else
+      apProtocol->GMCPModules &= ~GMCP_BIT(Module);
+  } else if (abSupported) {
+    apProtocol->GMCPSupports.emplace(GMCPModuleKey(aModule));
+  } else {
+    apProtocol->GMCPSupports.erase(GMCPModuleKey(aModule));
+  }
 }
 
 // Send GMCP variables that aren't in JSON format
 void SendGMCP(dPtr apDescriptor, const char* apVariable, const char* apValue)
 {
-  char GMCPBuffer[MAX_VARIABLE_LENGTH + 1] = {'\0'};
-
   if (apVariable != NULL && apValue != NULL) {
     protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-    /* Should really be replaced with a dynamic buffer */
-    int RequiredBuffer = strlen(apVariable) + strlen(apValue) + 12;
-
-    if (RequiredBuffer >= MAX_VARIABLE_LENGTH) {
-      if (RequiredBuffer - strlen(apValue) < MAX_VARIABLE_LENGTH) {
-        sprintf(GMCPBuffer, "SendGMCP: %s %d bytes (exceeds MAX_VARIABLE_LENGTH of %d).\n", apVariable, RequiredBuffer,
-                MAX_VARIABLE_LENGTH);
-      } else /* The variable name itself is too long */
-      {
-        sprintf(GMCPBuffer,
-                "SendGMCP: Variable name has a length of %d bytes (exceeds "
-                "MAX_VARIABLE_LENGTH of %d).\n",
-                RequiredBuffer, MAX_VARIABLE_LENGTH);
-      }
-
-      ReportBug(GMCPBuffer);
-      GMCPBuffer[0] = '\0';
-    } else if (pProtocol->bGMCP) {
-      sprintf(GMCPBuffer, "%c%c%c%s %s%c%c", IAC, SB, TELOPT_GMCP, apVariable, apValue, IAC, SE);
-    }
-
     /* Just in case someone calls this function without checking GMCP */
-    if (GMCPBuffer[0] != '\0')
-      Write(apDescriptor, GMCPBuffer);
+    if (pProtocol->bGMCP) {
+      string& Frame = QueueBuffer(apDescriptor);
+      FrameStart(Frame, (char)TELOPT_GMCP);
+      FrameAppend(Frame, apVariable);
+      Frame += ' ';
+      FrameAppend(Frame, apValue);
+      FrameEnd(Frame);
+    }
   }
 }
 
 // Send GMCP JSON variables
 void SendGMCPJ(dPtr apDescriptor, string apVariable, string apValue)
 {
-  char GMCPBuffer[MAX_SOCK_BUF] = {'\0'};
   protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
 
-  if (!apVariable.empty() && !apValue.empty()) {
-    /* Should really be replaced with a dynamic buffer */
-    int RequiredBuffer = apVariable.length() + apValue.length() + 5;
+  /* Just in case someone calls this function without checking GMCP */
+  if (!apVariable.empty() && !apValue.empty() && pProtocol->bGMCP) {
+    string& Frame = QueueBuffer(apDescriptor);
+    FrameStart(Frame, (char)TELOPT_GMCP);
+    FrameAppend(Frame, apVariable);
+    Frame += ' ';
+    FrameAppend(Frame, apValue);
+    FrameEnd(Frame);
+  }
+}
+
+gmcp_payload_t GMCPEncode(const char* apVariable, string_view aValue)
+{
+  string Payload;
 
-    if (RequiredBuffer >= MAX_SOCK_BUF) {
-      snprintf(GMCPBuffer, MAX_SOCK_BUF - 1, "SendGMCPJ: %s %d bytes (exceeds MAX_SOCK_BUF of %d).\n",
-               apVariable.c_str(), RequiredBuffer, MAX_SOCK_BUF);
+  Payload.reserve(strlen(apVariable) + aValue.length() + 6); /* 6: IAC SB GMCP, space, IAC SE */
+  FrameStart(Payload, (char)TELOPT_GMCP);
+  FrameAppend(Payload, apVariable);
+  Payload += ' ';
+  FrameAppend(Payload, aValue);
+  FrameEnd(Payload);
 
-      ReportBug(GMCPBuffer);
-      GMCPBuffer[0] = '\0';
-    } else if (pProtocol->bGMCP) {
-      snprintf(GMCPBuffer, MAX_SOCK_BUF - 1, "%c%c%c%s %s%c%c", IAC, SB, TELOPT_GMCP, apVariable.c_str(),
-               apValue.c_str(), IAC, SE);
-    }
+  return make_shared<const string>(std::move(Payload));
+}
 
-    /* Just in case someone calls this function without checking GMCP */
-    if (GMCPBuffer[0] != '\0')
-      Write(apDescriptor, GMCPBuffer);
+void GMCPSendPayload(dPtr apDescriptor, const gmcp_payload_t& apPayload)
+{
+  /* Just in case someone calls this function without checking GMCP */
+  if (apDescriptor != NULL && apDescriptor->pProtocol->bGMCP && apPayload)
+    QueueShared(apDescriptor, apPayload);
+}
+
+/* Appends the value as a quoted JSON string.  It's always going inside a GMCP
+ * subnegotiation, so any IAC is doubled as well.
+ */
+static void JSONAppendString(string& aResult, string_view aValue)
+{
+  static const char s_Hex[] = "0123456789abcdef";
+  size_t Start = 0, i;
+
+  aResult += '"';
+
+  for (i = 0; i < aValue.length(); ++i) {
+    unsigned char c = aValue[i];
+
+    if (c >= ' ' && c != '"' && c != '\\' && c != IAC)
+      continue;
+
+    /* Copy the run before it, then escape it */
+    aResult.append(aValue.data() + Start, i - Start);
+    Start = i + 1;
+
+    switch (c) {
+    case '"':
+      aResult += "\\\"";
+      break;
+    case '\\':
+      aResult += "\\\\";
+      break;
+    case '\n':
+      aResult += "\\n";
+      break;
+    case '\r':
+      aResult += "\\r";
+      break;
+    case '\t':
+      aResult += "\\t";
+      break;
+    case IAC:
+      aResult += (char)IAC;
+      aResult += (char)IAC;
+      break;
+    default: /* Any other control character */
+      aResult += "\\u00";
+      aResult += s_Hex[c >> 4];
+      aResult += s_Hex[c & 0xF];
+      break;
+    }
   }
+
+  aResult.append(aValue.data() + Start, aValue.length() - Start);
+  aResult += '"';
 }
 
 /******************************************************************************
@@ -2349,23 +4227,55 @@ static const char* GetMSSP_Uptime()
   return Buffer;
 }
 
+static const char* GetMSSP_Areas()
+{
+  static char Buffer[32];
+  sprintf(Buffer, "%d", (int)zone_table.size());
+  return Buffer;
+}
+
+static const char* GetMSSP_Mobiles()
+{
+  static char Buffer[32];
+  sprintf(Buffer, "%d", (int)mob_proto.size());
+  return Buffer;
+}
+
+static const char* GetMSSP_Objects()
+{
+  static char Buffer[32];
+  sprintf(Buffer, "%d", (int)obj_proto.size());
+  return Buffer;
+}
+
+static const char* GetMSSP_Rooms()
+{
+  static char Buffer[32];
+  sprintf(Buffer, "%d", (int)world.size());
+  return Buffer;
+}
+
 /* Macro for readability, but you can remove it if you don't like it */
 #define FUNCTION_CALL(f) "", f
 
 static void SendMSSP(dPtr apDescriptor)
 {
-  char MSSPBuffer[MAX_MSSP_BUFFER];
-  char MSSPPair[128];
-  int SizeBuffer = 3; /* IAC SB MSSP */
-  int i;              /* Loop counter */
-  string zoneTableSize = to_string(zone_table.size());
-  const char* numAreas = zoneTableSize.c_str();
-  string mobProtoSize = to_string(mob_proto.size());
-  const char* numMobiles = mobProtoSize.c_str();
-  string objProtoSize = to_string(obj_proto.size());
-  const char* numObjects = objProtoSize.c_str();
-  string worldSize = to_string(world.size());
-  const char* numRooms = worldSize.c_str();
+  QueueShared(apDescriptor, MSSPPayload(false));
+}
+
+/* Returns the MSSP response, either as a subnegotiation or as the plain text
+ * reply to MSSP-REQUEST.  Both are only encoded again if the players, uptime
+ * or size of the world have changed since last time.
+ */
+static const gmcp_payload_t& MSSPPayload(bool abPlainText)
+{
+  const int Counts[] = {s_Players, (int)s_Uptime, (int)zone_table.size(), (int)mob_proto.size(),
+                        (int)obj_proto.size(), (int)world.size()};
+  int i; /* Loop counter */
+
+  static_assert(sizeof(Counts) == sizeof(s_MSSPCounts), "s_MSSPCounts doesn't match");
+  if (s_pMSSP && !memcmp(Counts, s_MSSPCounts, sizeof(Counts)))
+    return abPlainText ? s_pMSSPText : s_pMSSP;
 
   /* Before updating the following table, please read the MSSP specification:
    *
@@ -2407,11 +4317,11 @@ static void SendMSSP(dPtr apDescriptor)
 */
       /* World */
 
-      {"AREAS", numAreas},
+      {"AREAS", FUNCTION_CALL(GetMSSP_Areas)},
       //      { "HELPFILES",          "0" },
-      {"MOBILES", numMobiles},
-      {"OBJECTS", numObjects},
-      {"ROOMS", numRooms},
+      {"MOBILES", FUNCTION_CALL(GetMSSP_Mobiles)},
+      {"OBJECTS", FUNCTION_CALL(GetMSSP_Objects)},
+      {"ROOMS", FUNCTION_CALL(GetMSSP_Rooms)},
       {"CLASSES", "5"},
       //      { "LEVELS",             "0" },
       {"RACES", "24"},
@@ -2484,36 +4394,337 @@ static void SendMSSP(dPtr apDescriptor)
       {NULL, NULL, NULL} /* This must always be last. */
   };
 
-  /* Begin the subnegotiation sequence */
-  sprintf(MSSPBuffer, "%c%c%c", IAC, SB, TELOPT_MSSP);
+  string Frame, Text = "\r\nMSSP-REPLY-START\r\n";
+  FrameStart(Frame, (char)TELOPT_MSSP);
 
   for (i = 0; MSSPTable[i].pName != NULL; ++i) {
-    int SizePair;
+    const char* pValue = MSSPTable[i].pFunction ? (*MSSPTable[i].pFunction)() : MSSPTable[i].pValue;
 
-    /* Retrieve the next MSSP variable/value pair */
-    sprintf(MSSPPair, "%c%s%c%s", MSSP_VAR, MSSPTable[i].pName, MSSP_VAL,
-            MSSPTable[i].pFunction ? (*MSSPTable[i].pFunction)() : MSSPTable[i].pValue);
+    Frame += (char)MSSP_VAR;
+    FrameAppend(Frame, MSSPTable[i].pName);
+    Frame += (char)MSSP_VAL;
+    FrameAppend(Frame, pValue);
 
-    /* Make sure we don't overflow the buffer */
-    SizePair = strlen(MSSPPair);
-    if (SizePair + SizeBuffer < MAX_MSSP_BUFFER - 4) {
-      strcat(MSSPBuffer, MSSPPair);
-      SizeBuffer += SizePair;
-    }
+    Text += MSSPTable[i].pName;
+    Text += '\t';
+    Text += pValue;
+    Text += "\r\n";
+  }
+
+  FrameEnd(Frame);
+  Text += "MSSP-REPLY-END\r\n";
+
+  /* Anyone still sending the old ones keeps their own reference to them */
+  s_pMSSP = make_shared<const string>(std::move(Frame));
+  s_pMSSPText = make_shared<const string>(std::move(Text));
+  memcpy(s_MSSPCounts, Counts, sizeof(Counts));
+  return abPlainText ? s_pMSSPText : s_pMSSP;
+}
+
+/* Looks for a request for MSSP in what the crawler has sent, and picks the
+ * form of the reply.  Unless abAnywhere is set, it must be right at the
+ * start, so that a client that isn't a crawler is never mistaken for one.
+ * Returns false if it's refused MSSP or sent too much without asking.
+ */
+static bool MSSPProbeParse(mssp_probe_t& aProbe, bool abAnywhere)
+{
+  static const char DoMSSP[] = {(char)IAC, (char)DO, TELOPT_MSSP, '\0'};
+  static const char DontMSSP[] = {(char)IAC, (char)DONT, TELOPT_MSSP, '\0'};
+  static const char Request[] = "MSSP-REQUEST";
+  size_t TelnetPos = aProbe.Input.find(DoMSSP);
+  size_t TextPos = aProbe.Input.find(Request);
+
+  if (TelnetPos == 0 || (abAnywhere && TelnetPos != string::npos)) {
+    aProbe.pReply = MSSPPayload(false);
+  } else if (TextPos == 0 || (abAnywhere && TextPos != string::npos)) {
+    aProbe.pReply = MSSPPayload(true);
+  } else /* Nothing we can answer yet */
+  {
+    if (abAnywhere && aProbe.Input.find(DontMSSP) == string::npos && aProbe.Input.length() < MAX_MSSP_PROBE_INPUT)
+      return true;
+    return false;
+  }
+
+  aProbe.State = eMSSP_PROBE_REPLYING;
+  aProbe.Sent = 0;
+  return true;
+}
+
+/* Writes as much of the reply as the socket will take */
+static void MSSPProbeWrite(mssp_probe_t& aProbe)
+{
+  const string& Reply = *aProbe.pReply;
+  ssize_t Sent = write(aProbe.Socket, Reply.data() + aProbe.Sent, Reply.length() - aProbe.Sent);
+
+  if (Sent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      aProbe.State = eMSSP_PROBE_DONE;
+  } else if ((aProbe.Sent += Sent) == Reply.length()) {
+    aProbe.State = eMSSP_PROBE_DONE;
+  }
+}
+
+/* Returns a pointer to the first IAC or ESC in the range, or apEnd if there
+ * aren't any.  Nearly all input is plain text, so this checks 32 or 16 bytes
+ * at a time where the CPU allows it.
+ */
+static const char* FindTelnetOrEscape(const char* apStart, const char* apEnd)
+{
+  const char* pPos = apStart;
+
+#if defined(__AVX2__)
+  const __m256i Iac32 = _mm256_set1_epi8((char)IAC);
+  const __m256i Esc32 = _mm256_set1_epi8((char)27);
+
+  for (; apEnd - pPos >= 32; pPos += 32) {
+    __m256i Block = _mm256_loadu_si256((const __m256i*)pPos);
+    unsigned int Mask = (unsigned int)_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(Block, Iac32), _mm256_cmpeq_epi8(Block, Esc32)));
+    if (Mask != 0)
+      return pPos + __builtin_ctz(Mask);
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i Iac16 = _mm_set1_epi8((char)IAC);
+  const __m128i Esc16 = _mm_set1_epi8((char)27);
+
+  for (; apEnd - pPos >= 16; pPos += 16) {
+    __m128i Block = _mm_loadu_si128((const __m128i*)pPos);
+    unsigned int Mask =
+        (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(Block, Iac16), _mm_cmpeq_epi8(Block, Esc16)));
+    if (Mask != 0)
+      return pPos + __builtin_ctz(Mask);
+  }
+#endif
+
+  /* Whatever's left, or everything if there's no SIMD support */
+  for (; pPos < apEnd; ++pPos) {
+    if (*pPos == (char)IAC || *pPos == (char)27)
+      break;
+  }
+
+  return pPos;
+}
+
+/******************************************************************************
+ Local copyover functions.
+ ******************************************************************************/
+
+/* The snapshot is only read back by the same machine, so ints are written
+ * as they are in memory.
+ */
+static void SnapshotPutInt(string& aSnapshot, int32_t aValue)
+{
+  aSnapshot.append((const char*)&aValue, sizeof(aValue));
+}
+
+static void SnapshotPutString(string& aSnapshot, string_view aValue)
+{
+  SnapshotPutInt(aSnapshot, aValue.length());
+  aSnapshot.append(aValue.data(), aValue.length());
+}
+
+static bool SnapshotGetInt(string_view& aSnapshot, int32_t& aValue)
+{
+  if (aSnapshot.length() < sizeof(aValue))
+    return false;
+
+  memcpy(&aValue, aSnapshot.data(), sizeof(aValue));
+  aSnapshot.remove_prefix(sizeof(aValue));
+  return true;
+}
+
+static bool SnapshotGetString(string_view& aSnapshot, string& aValue)
+{
+  int32_t Length;
+
+  if (!SnapshotGetInt(aSnapshot, Length) || Length < 0 || (size_t)Length > aSnapshot.length())
+    return false;
+
+  aValue.assign(aSnapshot.data(), Length);
+  aSnapshot.remove_prefix(Length);
+  return true;
+}
+
+/* Reads the next record.  Returns its version, or 0 at the end of the file
+ * or if the rest of it can't be read.
+ */
+static int SnapshotRead(FILE* apFile, int32_t& aSocket, string& aBody)
+{
+  char Header[4 + 3 * sizeof(int32_t)];
+  int32_t Version, Length;
+
+  if (fread(Header, 1, sizeof(Header), apFile) != sizeof(Header) || memcmp(Header, "PSNP", 4))
+    return 0;
+
+  memcpy(&Version, Header + 4, sizeof(Version));
+  memcpy(&aSocket, Header + 4 + sizeof(Version), sizeof(aSocket));
+  memcpy(&Length, Header + 4 + 2 * sizeof(Version), sizeof(Length));
+  /* Don't trust the length, the file may be truncated or from elsewhere */
+  if (Version <= 0 || Length < 0 || Length > MAX_SNAPSHOT_RECORD)
+    return 0;
+
+  aBody.resize(Length);
+  if (fread(&aBody[0], 1, Length, apFile) != (size_t)Length)
+    return 0;
+
+  return Version;
+}
+
+/* Puts the player back the way they were.  Returns false if the snapshot
+ * ends early, in which case CopyoverSet() renegotiates as usual.
+ */
+static bool SnapshotRestore(dPtr apDescriptor, string_view aBody)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  int32_t Value[13], Count, bReport, bDirty, bString, Number;
+  oob_mask_t Dirty = 0;
+  string Text;
+  size_t i; /* Loop counter */
+
+  for (i = 0; i < sizeof(Value) / sizeof(Value[0]); ++i) {
+    if (!SnapshotGetInt(aBody, Value[i]))
+      return false;
+  }
+
+  pProtocol->bNegotiated = Value[0];
+  pProtocol->bTTYPE = Value[1];
+  pProtocol->bNAWS = Value[2];
+  pProtocol->bCHARSET = Value[3];
+  pProtocol->bMSDP = Value[4];
+  pProtocol->bMSP = Value[5];
+  pProtocol->bMXP = Value[6];
+  pProtocol->bGMCP = Value[7];
+  pProtocol->bBlockMXP = Value[8];
+  pProtocol->b256Support = (support_t)Value[9];
+  pProtocol->ScreenWidth = Value[10];
+  pProtocol->ScreenHeight = Value[11];
+  if (Value[12] >= 0 && Value[12] < eCOMPRESS_MAX)
+    pProtocol->CompressClass = (compress_class_t)Value[12];
+
+  if (!SnapshotGetString(aBody, Text))
+    return false;
+  free(pProtocol->pMXPVersion);
+  pProtocol->pMXPVersion = AllocString(Text.c_str());
+
+  if (!SnapshotGetString(aBody, pProtocol->Host) || !SnapshotGetInt(aBody, Count))
+    return false;
+
+  pProtocol->GMCPModules = 0;
+  pProtocol->GMCPSupports.clear();
+  while (Count-- > 0) {
+    if (!SnapshotGetString(aBody, Text))
+      return false;
+    GMCPSetSupport(pProtocol, Text, true);
+  }
+
+  if (!SnapshotGetInt(aBody, Count))
+    return false;
+
+  pProtocol->Variables.Report = 0;
+  pProtocol->Variables.Dirty = 0;
+  while (Count-- > 0) {
+    if (!SnapshotGetString(aBody, Text) || !SnapshotGetInt(aBody, bReport) || !SnapshotGetInt(aBody, bDirty)
+        || !SnapshotGetInt(aBody, bString))
+      return false;
+
+    variable_t Variable = LookupVariable(Text);
+    if (bString ? !SnapshotGetString(aBody, Text) : !SnapshotGetInt(aBody, Number))
+      return false;
+
+    /* Skip any that have gone, or changed type, since the snapshot */
+    if (Variable == eOOB_NONE || VariableNameTable[Variable].bString != (bool)bString)
+      continue;
+
+    if (bString)
+      pProtocol->Variables.ValueString[Variable] = Text;
+    else
+      pProtocol->Variables.ValueInt[Variable] = Number;
+    if (bReport)
+      pProtocol->Variables.Report |= OOB_BIT(Variable);
+    if (bDirty)
+      Dirty |= OOB_BIT(Variable);
   }
 
-  /* End the subnegotiation sequence */
-  sprintf(MSSPPair, "%c%c", IAC, SE);
-  strcat(MSSPBuffer, MSSPPair);
+  /* Anything that was waiting to go out still needs to */
+  if (Dirty != 0)
+    OOBMarkDirty(apDescriptor, Dirty);
 
-  /* Send the sequence */
-  Write(apDescriptor, MSSPBuffer);
+  pProtocol->bRestored = true;
+  return true;
 }
 
 /******************************************************************************
  Local MXP functions.
  ******************************************************************************/
 
+static void ParseMXP(dPtr apDescriptor, const char* apData)
+{
+  protocol_t* pProtocol = apDescriptor->pProtocol;
+  char* pMXPTag = NULL;
+
+  if ((pMXPTag = GetMxpTag("SUPPORTS", apData)) != NULL) {
+    InfoMessage(apDescriptor, "MXP SUPPORTS: ");
+    Write(apDescriptor, apData);
+    Write(apDescriptor, "\r\n");
+  }
+
+  if ((pMXPTag = GetMxpTag("CLIENT=", apData)) != NULL) {
+    /* Overwrite the previous client name - this is harder to fake */
+    pProtocol->Variables.ValueString[eOOB_CLIENT_ID] = pMXPTag;
+  }
+
+  if ((pMXPTag = GetMxpTag("VERSION=", apData)) != NULL) {
+    const char* pClientName = pProtocol->Variables.ValueString[eOOB_CLIENT_ID].c_str();
+
+    // InfoMessage(apDescriptor, "Received MXP Version From Client: ");
+    // Write(apDescriptor, pMXPTag);
+    // Write(apDescriptor, "\r\n");
+    // MXPSendTag( apDescriptor, "<SUPPORT>" );
+
+    pProtocol->Variables.ValueString[eOOB_CLIENT_VERSION] = pMXPTag;
+
+    if (MatchString("MUSHCLIENT", pClientName)) {
+      /* MUSHclient 4.02 and later supports 256 colours. */
+      if (strcmp(pMXPTag, "4.02") >= 0) {
+        pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
+        pProtocol->b256Support = eYES;
+      } else /* We know for sure that 256 colours are not supported */
+        pProtocol->b256Support = eNO;
+    } else if (MatchString("CMUD", pClientName)) {
+      /* CMUD 3.04 and later supports 256 colours. */
+      if (strcmp(pMXPTag, "3.04") >= 0) {
+        pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
+        pProtocol->b256Support = eYES;
+      } else /* We know for sure that 256 colours are not supported */
+        pProtocol->b256Support = eNO;
+    } else if (MatchString("ATLANTIS", pClientName)) {
+      /* Atlantis 0.9.9.0 supports XTerm 256 colours, but it doesn't
+       * yet have MXP.  However MXP is planned, so once it responds
+       * to a <VERSION> tag we'll know we can use 256 colours.
+       */
+      pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS] = 1;
+      pProtocol->b256Support = eYES;
+    }
+  }
+
+  if ((pMXPTag = GetMxpTag("MXP=", apData)) != NULL) {
+    free(pProtocol->pMXPVersion);
+    pProtocol->pMXPVersion = AllocString(pMXPTag);
+  }
+
+  /* No longer necessary
+   *
+  if ( strcmp(pProtocol->pMXPVersion, "Unknown") )
+  {
+     Write( apDescriptor, "\n" );
+     sprintf( MXPBuffer, "MXP version %s detected and enabled.\r\n",
+        pProtocol->pMXPVersion );
+     InfoMessage( apDescriptor, MXPBuffer );
+  } */
+}
+
 static char* GetMxpTag(const char* apTag, const char* apText)
 {
   static char MXPBuffer[64];
@@ -2552,6 +4763,78 @@ static char* GetMxpTag(const char* apTag, const char* apText)
  Local colour functions.
  ******************************************************************************/
 
+static void ColourInit(void)
+{
+  int i; /* Loop counter */
+
+  for (i = 0; i < MAX_RGB_COLOURS; ++i) {
+    bool bBackground = (i >= MAX_RGB_COLOURS / 2);
+    int Colour = i % (MAX_RGB_COLOURS / 2);
+    int Red = Colour / 36, Green = (Colour / 6) % 6, Blue = Colour % 6;
+
+    strcpy(s_XTermColours[i], GetRGBColour(bBackground, Red, Green, Blue));
+    s_AnsiColours[i] = GetAnsiColour(bBackground, Red, Green, Blue);
+  }
+
+  for (i = 0; i < 256; ++i)
+    s_ColourCodes[i] = NO_COLOUR;
+
+  for (i = 0; s_ColourCodeTable[i].pRGB != NULL; ++i)
+    s_ColourCodes[(unsigned char)s_ColourCodeTable[i].Code] = ColourIndex(s_ColourCodeTable[i].pRGB);
+}
+
+static colour_mode_t GetColourMode(dPtr apDescriptor)
+{
+  protocol_t* pProtocol = apDescriptor ? apDescriptor->pProtocol : NULL;
+
+  if (pProtocol == NULL || !pProtocol->Variables.ValueInt[eOOB_ANSI_COLORS])
+    return eCOLOUR_NONE;
+  else if (apDescriptor->character && !clr(apDescriptor->character, C_CMP))
+    return eCOLOUR_NONE;
+  else if (pProtocol->Variables.ValueInt[eOOB_XTERM_256_COLORS])
+    return eCOLOUR_XTERM;
+  else /* Use regular ANSI colour */
+    return eCOLOUR_ANSI;
+}
+
+static const char* GetColour(colour_mode_t aMode, int aColour)
+{
+  if (aMode == eCOLOUR_NONE) /* Don't send any colour, not even clear */
+    return "";
+  else if (aColour == NO_COLOUR) /* Invalid colour - use this to clear any existing colour */
+    return s_Clean;
+  else if (aMode == eCOLOUR_XTERM)
+    return s_XTermColours[aColour];
+  else /* Use regular ANSI colour */
+    return s_AnsiColours[aColour];
+}
+
+/* Returns the colour number for a four character sequence such as "F500", or
+ * NO_COLOUR if it's invalid.  Anything after the fourth character is ignored.
+ */
+static int ColourIndex(const char* apRGB)
+{
+  int Colour = 0;
+  int i; /* Loop counter */
+
+  if (apRGB == NULL)
+    return NO_COLOUR;
+
+  /* The first byte indicates foreground/background. */
+  if (tolower(apRGB[0]) == 'b')
+    Colour = MAX_RGB_COLOURS / 2;
+  else if (tolower(apRGB[0]) != 'f')
+    return NO_COLOUR;
+
+  /* The remaining three bytes must each be in the range '0' to '5'. */
+  for (i = 1; i <= 3; ++i) {
+    if (apRGB[i] < '0' || apRGB[i] > '5')
+      return NO_COLOUR;
+  }
+
+  return Colour + (apRGB[1] - '0') * 36 + (apRGB[2] - '0') * 6 + (apRGB[3] - '0');
+}
+
 static const char* GetAnsiColour(bool abBackground, int aRed, int aGreen, int aBlue)
 {
   if (aRed == aGreen && aRed == aBlue && aRed < 2)
@@ -2583,28 +4866,6 @@ static const char* GetRGBColour(bool abBackground, int aRed, int aGreen, int aBl
   return Result;
 }
 
-static bool IsValidColour(const char* apArgument)
-{
-  int i; /* Loop counter */
-
-  /* The sequence is 4 bytes, but we can ignore anything after it. */
-  if (apArgument == NULL || strlen(apArgument) < 4)
-    return false;
-
-  /* The first byte indicates foreground/background. */
-  if (tolower(apArgument[0]) != 'f' && tolower(apArgument[0]) != 'b')
-    return false;
-
-  /* The remaining three bytes must each be in the range '0' to '5'. */
-  for (i = 1; i <= 3; ++i) {
-    if (apArgument[i] < '0' || apArgument[i] > '5')
-      return false;
-  }
-
-  /* It's a valid foreground or background colour */
-  return true;
-}
-
 /******************************************************************************
  Other local functions.
  ******************************************************************************/
@@ -2618,15 +4879,81 @@ static bool MatchString(const char* apFirst, const char* apSecond)
   return (!*apFirst && !*apSecond);
 }
 
-static bool PrefixString(const char* apPart, const char* apWhole)
+static bool MatchString(string_view aFirst, const char* apSecond)
+{
+  size_t i = 0; /* Loop counter */
+
+  while (i < aFirst.length() && tolower(aFirst[i]) == tolower(apSecond[i]))
+    ++i;
+  return (i == aFirst.length() && !apSecond[i]);
+}
+
+/* FNV-1a of the lowercased name, with the seed mixed into the offset basis */
+static uint32_t HashName(string_view aName, uint32_t aSeed)
+{
+  uint32_t Hash = 2166136261u ^ aSeed;
+
+  for (char c : aName) {
+    Hash ^= (unsigned char)tolower(c);
+    Hash *= 16777619u;
+  }
+
+  return Hash;
+}
+
+/* Finds a seed that gives each name a slot of its own with HashName().  The
+ * slots are sized to a power of two, and hold the index of the name or -1.
+ * It's only meant to be used at startup.
+ */
+static uint32_t PerfectHash(const vector<const char*>& aNames, vector<int>& aSlots)
+{
+  size_t Size = 2;
+  size_t i; /* Loop counter */
+
+  while (Size < aNames.size() * 2)
+    Size *= 2;
+
+  for (;;) {
+    for (uint32_t Seed = 0; Seed < MAX_HASH_SEEDS; ++Seed) {
+      bool bCollision = false;
+
+      aSlots.assign(Size, -1);
+      for (i = 0; i < aNames.size() && !bCollision; ++i) {
+        int& Slot = aSlots[HashName(aNames[i], Seed) & (Size - 1)];
+        if (Slot != -1)
+          bCollision = true;
+        else
+          Slot = i;
+      }
+
+      if (!bCollision)
+        return Seed;
+    }
+
+    /* Nothing worked at this size, so give it more room */
+    Size *= 2;
+  }
+}
+
+static bool PrefixString(const char* apPart, string_view aWhole)
 {
-  while (*apPart && tolower(*apPart) == tolower(*apWhole)) {
+  size_t i = 0; /* Loop counter */
+
+  while (*apPart && i < aWhole.length() && tolower(*apPart) == tolower(aWhole[i])) {
     ++apPart;
-    ++apWhole;
+    ++i;
   }
   return (!*apPart);
 }
 
+/* Like aData[aIndex], but reading past the end gives a NUL, the same as it
+ * would for a C string.
+ */
+static char CharAt(string_view aData, size_t aIndex)
+{
+  return aIndex < aData.length() ? aData[aIndex] : '\0';
+}
+
 static bool IsNumber(const char* apString)
 {
   while (*apString && isdigit(*apString))
@@ -12,9 +12,16 @@
 #define PROTOCOL_H
 
 #include "type.h"
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <sys/types.h>
 #include <unordered_set>
-#include <zconf.h>
+#include <vector>
+#include <zlib.h>
 
 using namespace std;
 
@@ -27,14 +34,22 @@ using namespace std;
 typedef struct descriptor_data descriptor_t;
 
 /******************************************************************************
- If your mud supports MCCP (compression), uncomment the next line.
+ If your mud supports MCCP (compression), uncomment the next line.  The
+ compression is then done in ProtocolFlush(), so comm.cpp must drop its own
+ d->comp handling and mustn't write to the socket directly - see PROTOCOL.md.
  ******************************************************************************/
 
-// buggy on copyover so disabled
 //#define USING_MCCP true
 
-extern void* z_alloc(void* opaque, uInt items, uInt size);
-extern void z_free(void* opaque, void* address);
+/******************************************************************************
+ To offer every protocol as soon as the user connects, instead of waiting for
+ the client to answer TTYPE first, uncomment the next line.  Clients that turn
+ out not to understand telnet cause their host to be negotiated with the old
+ way from then on.  That doesn't catch clients which speak telnet but crash on
+ one of the offers, such as gnome-mud with DO CHARSET (see Negotiate).
+ ******************************************************************************/
+
+//#define OPTIMISTIC_NEGOTIATION true
 
 /******************************************************************************
  If your offer a Mudlet GUI for autoinstallation, put the path/filename here.
@@ -51,7 +66,30 @@ extern void z_free(void* opaque, void* address);
 #define MAX_PROTOCOL_BUFFER MAX_RAW_INPUT_LENGTH
 #define MAX_VARIABLE_LENGTH 4096
 #define MAX_OUTPUT_BUFFER LARGE_BUFSIZE
-#define MAX_MSSP_BUFFER 4096
+#define MAX_MXP_BUFFER 1024
+#define MAX_OUTPUT_CACHE 512       /* Rendered strings kept by ProtocolOutput */
+#define MIN_OUTPUT_CACHE_LENGTH 64 /* Shorter strings aren't worth caching */
+#define MAX_OUTPUT_CACHE_SEEN 4096 /* Strings remembered as seen once, by hash */
+#define MAX_GMCP_DEPTH 8           /* Deepest JSON nesting accepted from clients */
+#define MAX_HASH_SEEDS 1024        /* Seeds to try before growing a name hash */
+#define MAX_OUTPUT_IOV 64          /* Queued chunks sent per writev() call */
+#define MAX_OUTPUT_QUEUE 1048576   /* Unsent bytes a descriptor may build up */
+#define MCCP_FINISH_WAIT 2000      /* Milliseconds copyover waits to end streams */
+#define MCCP3_SKIP_WAIT 10         /* Seconds input is dropped after copyover */
+#define MIN_DEFLATE_ROOM 64        /* Extra room given to each deflate() call */
+#define MAX_INFLATE_BUFFER 4096    /* Input inflated per pass of the parser */
+#define MAX_DICTIONARY 32768       /* zlib can't use any more than this */
+#define MIN_DICTIONARY_LINE 8      /* Shorter lines aren't worth including */
+#define MAX_ZLIB_POOL 33554432     /* Bytes of freed zlib memory kept for reuse */
+#define MAX_PLAIN_HOSTS 1024       /* Hosts remembered as not speaking telnet */
+#define MAX_FINGERPRINTS 512       /* Clients remembered by host and first TTYPE */
+#define FINGERPRINT_VERIFY 16      /* Recheck a client every this many hits */
+#define MAX_CLIENT_NAME 64         /* Longest TTYPE reply stored */
+#define MAX_MSSP_PROBES 64         /* Crawlers being answered at once */
+#define MAX_MSSP_PROBE_INPUT 64    /* Bytes a crawler may send before its request */
+#define MSSP_PROBE_TIMEOUT 30      /* Seconds a crawler has to ask and read */
+#define SNAPSHOT_VERSION 1         /* Change whenever the snapshot layout does */
+#define MAX_SNAPSHOT_RECORD 262144 /* Bytes a player's snapshot may take up */
 
 #define pSEND 1
 #define pACCEPTED 2
@@ -60,7 +98,8 @@ extern void z_free(void* opaque, void* address);
 #define TELOPT_CHARSET 42
 #define TELOPT_MSDP 69
 #define TELOPT_MSSP 70
-#define TELOPT_MCCP 86 /* This is MCCP version 2 */
+#define TELOPT_MCCP 86  /* This is MCCP version 2 */
+#define TELOPT_MCCP3 87 /* MCCP version 3, compressing what the client sends */
 #define TELOPT_MSP 90
 #define TELOPT_MXP 91
 #define TELOPT_ATCP 200
@@ -93,6 +132,19 @@ extern void z_free(void* opaque, void* address);
 
 typedef enum { eUNKNOWN, eNO, eSOMETIMES, eYES } support_t;
 
+/* Where ProtocolInput() got to when the last read ran out of data, so that a
+ * sequence split across two reads can be picked up again on the next one.
+ */
+typedef enum {
+  eINPUT_DATA,    /* In-band data */
+  eINPUT_IAC,     /* Received IAC */
+  eINPUT_COMMAND, /* Received IAC WILL/WONT/DO/DONT, waiting for the option */
+  eINPUT_SB,      /* Inside a subnegotiation */
+  eINPUT_SB_IAC,  /* Received IAC inside a subnegotiation */
+  eINPUT_ESC,     /* Received ESC, might be the start of an MXP reply */
+  eINPUT_MXP      /* Reading an MXP reply up to the closing '>' */
+} input_state_t;
+
 typedef enum {
   eOOB_NONE = -1, /* This must always be first. */
 
@@ -183,14 +235,55 @@ typedef struct
   const char* pDefault;      /* The default value for a string */
 } variable_name_t;
 
+/* One bit per variable_t, used for the report and dirty sets */
+typedef uint64_t oob_mask_t;
+
+#define OOB_BIT(x) ((oob_mask_t)1 << (x))
+
+static_assert(eOOB_MAX <= 64, "variable_t no longer fits in oob_mask_t");
+
 typedef struct
 {
-  bool bReport;       /* Is this variable being reported? */
-  bool bDirty;        /* Does this variable need to be sent again? */
-  int ValueInt;       /* The numeric value of the variable */
-  char* pValueString; /* The string value of the variable */
+  oob_mask_t Report;            /* Which variables are being reported */
+  oob_mask_t Dirty;             /* Which variables need to be sent again */
+  int ValueInt[eOOB_MAX];       /* The numeric values of the variables */
+  string ValueString[eOOB_MAX]; /* The string values of the variables */
 } OOB_t;
 
+/* The GMCP modules the mud knows about.  Clients can list others in
+ * Core.Supports, but these are the only ones that get a bit of their own.
+ */
+typedef enum {
+  eGMCP_NONE = -1, /* Not one of ours */
+
+  eGMCP_CORE,
+  eGMCP_GENERAL,
+  eGMCP_CHAR,
+  eGMCP_CHAR_NAME,
+  eGMCP_CHAR_VITALS,
+  eGMCP_CHAR_STATUSVARS,
+  eGMCP_CHAR_STATUS,
+  eGMCP_CHAR_STATS,
+  eGMCP_COMBAT,
+  eGMCP_WORLD,
+  eGMCP_ROOM,
+  eGMCP_ROOM_INFO,
+  eGMCP_CONFIG,
+  eGMCP_CLIENT_GUI,
+  eGMCP_CLIENT_MAP,
+  eGMCP_CLIENT_MEDIA,
+  eGMCP_EXTERNAL_DISCORD,
+
+  eGMCP_MAX /* This must always be last */
+} gmcp_module_t;
+
+/* One bit per gmcp_module_t */
+typedef uint32_t gmcp_mask_t;
+
+#define GMCP_BIT(x) ((gmcp_mask_t)1 << (x))
+
+static_assert(eGMCP_MAX <= 32, "gmcp_module_t no longer fits in gmcp_mask_t");
+
 typedef struct
 {
   const char* pName;              /* The name of the MSSP variable */
@@ -198,10 +291,74 @@ typedef struct
   const char* (*pFunction)(void); /* Optional function to return the value */
 } MSSP_t;
 
+/* A complete GMCP message, IAC SB GMCP through IAC SE, shared between every
+ * descriptor it's sent to.  It can't be changed once it's been encoded.
+ */
+typedef shared_ptr<const string> gmcp_payload_t;
+
+/* Each connection class has its own MCCP settings, so the trade-off between
+ * bandwidth, CPU and memory can be made separately for each.
+ */
+typedef enum
+{
+  eCOMPRESS_NORMAL, /* The default */
+  eCOMPRESS_FAST,   /* Light on CPU and memory, e.g. for idle links */
+  eCOMPRESS_BEST,   /* The smallest output, e.g. for slow links */
+
+  eCOMPRESS_MAX /* This must always be last */
+} compress_class_t;
+
+typedef struct
+{
+  int Level;         /* 1 (fastest) to 9 (smallest) */
+  int WindowBits;    /* 9 to 15, for a window of 2^WindowBits bytes */
+  int MemLevel;      /* 1 to 9, the size of the hash table */
+  int Strategy;      /* Z_DEFAULT_STRATEGY, Z_FILTERED and so on */
+  string Dictionary; /* Preset dictionary, which the client must also have */
+} compress_profile_t;
+
+typedef enum
+{
+  eCHUNK_DATA,           /* Bytes to send */
+  eCHUNK_COMPRESS_START, /* MCCP starts here */
+  eCHUNK_COMPRESS_END    /* MCCP finishes here */
+} chunk_type_t;
+
+/* Output waiting for ProtocolFlush().  Most chunks own their bytes, but a
+ * shared payload is queued as-is rather than copied.  MCCP is started and
+ * stopped by chunks in the queue, so it switches at the right point in the
+ * output.
+ */
+typedef struct
+{
+  string Data;            /* The bytes, unless it's shared */
+  gmcp_payload_t pShared; /* A payload shared with other descriptors */
+  chunk_type_t Type;      /* Data, unless it's an MCCP marker */
+} output_chunk_t;
+
+typedef struct
+{
+  unsigned long Flushes;  /* ProtocolFlush() calls that had something to send */
+  unsigned long Syscalls; /* System calls made sending it */
+  unsigned long Corked;   /* Flushes of more than one piece, sent corked */
+  unsigned long Blocked;  /* Flushes that filled the socket */
+  unsigned long Bytes;    /* Total bytes sent */
+} flush_stats_t;
+
+typedef struct
+{
+  unsigned long Allocs;   /* z_alloc() calls */
+  unsigned long Hits;     /* Those served from the pool */
+  unsigned long Frees;    /* z_free() calls */
+  unsigned long Released; /* Those freed for real, as the pool was full */
+  size_t InUseBytes;      /* Held by live streams */
+  size_t PooledBytes;     /* Waiting in the pool */
+  size_t PooledBlocks;    /* Blocks waiting in the pool */
+} zlib_pool_stats_t;
+
 typedef struct
 {
   int WriteOOB;          /* Used internally to indicate OOB data */
-  bool bIACMode;         /* Current mode - deals with broken packets */
   bool bNegotiated;      /* Indicates client successfully negotiated */
   bool bBlockMXP;        /* Used internally based on MXP version */
   bool bTTYPE;           /* The client supports TTYPE */
@@ -212,14 +369,47 @@ typedef struct
   bool bMXP;             /* The client supports MXP */
   bool bGMCP;            // The client supports GMCP
   bool bMCCP;            /* The client supports MCCP */
+  bool bMCCP3;           /* The client supports MCCP3 */
   support_t b256Support; /* The client supports XTerm 256 colors */
   int ScreenWidth;       /* The client's screen width */
   int ScreenHeight;      /* The client's screen height */
   char* pMXPVersion;     /* The version of MXP supported */
   char* pLastTTYPE;      /* Used for the cyclic TTYPE check */
-  OOB_t** pVariables;    /* The MSDP variables */
-  unordered_set<string> GMCPSupports;
+  OOB_t Variables;       /* The MSDP variables */
   bool destroyed;
+  bool bQueuedOOB;       /* Waiting in the OOBUpdateAll() list */
+  bool bOptimistic;      /* Everything was offered at once on connection */
+  bool bHeardIAC;        /* The client has sent a telnet command */
+  string Host;           /* Where the user connected from */
+  string Fingerprint;    /* The host and first TTYPE, for the client cache */
+  bool bFingerprinted;   /* The client's capabilities are known */
+  bool bRestored;        /* Its state came from a copyover snapshot */
+
+  /* GMCP modules the client has listed in Core.Supports */
+  gmcp_mask_t GMCPModules;            /* The ones in gmcp_module_t */
+  unordered_set<string> GMCPSupports; /* Any others */
+
+  /* Input parser state - deals with broken packets */
+  input_state_t InputState; /* Where the last read left off */
+  char InputCommand;        /* The WILL/WONT/DO/DONT awaiting its option */
+  int SubLength;            /* Bytes of subnegotiation read so far */
+  int MXPLength;            /* Bytes of MXP reply read so far */
+  char SubBuffer[MAX_PROTOCOL_BUFFER + 1];
+  char MXPBuffer[MAX_MXP_BUFFER];
+
+  /* Negotiation and OOB data waiting to be sent */
+  deque<output_chunk_t> OutputQueue; /* Oldest first */
+  size_t OutputOffset;               /* Bytes of the first chunk already sent */
+
+  /* MCCP - while it's on (or queued to change), output goes through here */
+  compress_class_t CompressClass; /* The settings used when it starts */
+  z_stream* pDeflate;             /* The compression stream, if it has started */
+  int CompressMarkers;            /* MCCP start/end chunks still in OutputQueue */
+  string Deflated;                /* Output that's been through the MCCP stage */
+  size_t DeflatedOffset;          /* Bytes of it already sent */
+  z_stream* pInflate;             /* MCCP3 - the client's stream, if it has started */
+  time_t SkipUntil;               /* MCCP3 - input is dropped until then after copyover */
+  int SkipMatched;                /* Bytes of the TIMING-MARK reply that ends it */
 } protocol_t;
 
 /******************************************************************************
@@ -247,6 +437,9 @@ void ProtocolDestroy(protocol_t* apProtocol);
  * wish to perform negotiation (but only call it once).  It is usually called
  * either immediately after the user has connected, or just after they have
  * entered the game.
+ *
+ * With OPTIMISTIC_NEGOTIATION every offer goes out at once, and ends up in
+ * the same packet as the greeting if this is called before it's sent.
  */
 void ProtocolNegotiate(dPtr apDescriptor);
 
@@ -255,6 +448,15 @@ void ProtocolNegotiate(dPtr apDescriptor);
  * Extracts any negotiation sequences from the input buffer, and passes back
  * whatever is left for the mud to parse normally.  Call this after data has
  * been read into the input buffer, before it is used for anything else.
+ *
+ * The in-band data is written to apOut (which is NUL terminated, but not
+ * appended to - pass the position where the new data should go) and the
+ * number of bytes written is returned, or -1 if it wouldn't fit in aOutSize.
+ * Sequences split across reads are remembered in the protocol structure and
+ * finished off on the next call, so there's no shared state between users.
+ *
+ * Once the client has started MCCP3, everything after the start sequence is
+ * inflated before it's parsed.
  */
 
 /* MUD Primary Colours */
@@ -262,7 +464,7 @@ extern const char* RGBone;
 extern const char* RGBtwo;
 extern const char* RGBthree;
 
-ssize_t ProtocolInput(dPtr apDescriptor, char* apData, int aSize, char* apOut);
+ssize_t ProtocolInput(dPtr apDescriptor, const char* apData, int aSize, char* apOut, int aOutSize);
 
 /* Function: ProtocolOutput
  *
@@ -326,10 +528,86 @@ ssize_t ProtocolInput(dPtr apDescriptor, char* apData, int aSize, char* apOut);
  */
 const char* ProtocolOutput(dPtr apDescriptor, const char* apData, int* apLength);
 
+/* Function: ProtocolOutput
+ *
+ * Works like the version above, but appends the result to aResult instead of
+ * returning a shared buffer, so there's no limit on the size of the output
+ * and it's safe to call from more than one thread (as long as each user is
+ * only handled by one thread at a time).  The version above is a wrapper for
+ * this one, returning a per-thread buffer that's only valid until the next
+ * call.
+ */
+void ProtocolOutput(dPtr apDescriptor, string_view aData, string& aResult);
+
+/* Function: ProtocolOutputInvalidate
+ *
+ * ProtocolOutput() caches the results for longer strings, as the same room
+ * descriptions, help files and channel messages get sent to lots of users.
+ * A string is only cached the second time it's rendered, so one-off text
+ * such as prompts doesn't push the shared text out, and never if rendering it
+ * reported a bug.  Entries are matched on the full text so an edited string
+ * is never served stale, but call this when OLC changes or frees a string so the old copies
+ * don't sit in the cache.  Passing NULL empties the whole cache.
+ */
+void ProtocolOutputInvalidate(const char* apData);
+
+/* Function: ProtocolFlush
+ *
+ * Telnet negotiation, MSDP, GMCP and MSSP don't go through the mud's output
+ * buffer, but are queued in the protocol structure and sent from there with
+ * writev(), so they're never copied into the output buffer first.  Call this
+ * once per descriptor on each pass of the game loop, passing the rendered
+ * text process_output() would otherwise have written, so that everything the
+ * descriptor produced during the pulse goes out in a single system call.  The
+ * socket is corked while it's sent if there's more than one piece, so the
+ * pieces are packed into full packets and the last one goes out on uncork.
+ * Nagle is left as it was, for anything else that writes to the socket.
+ *
+ * Any of aText that doesn't fit in the socket is queued behind the protocol
+ * data, so the caller can treat it as sent.  If a client stops reading and
+ * more than MAX_OUTPUT_QUEUE bytes build up, it returns -1 so the descriptor
+ * gets closed, rather than buffering its output for ever.
+ *
+ * MCCP is handled here too: once the client has agreed to it, everything is
+ * deflated on its way out, and the stream is flushed at the end of each call
+ * so the prompt isn't held back.  The mud must not write to the socket any
+ * other way while it's on, as the client would be expecting compressed data.
+ *
+ * Returns the number of bytes sent, 0 if there was nothing to send or the
+ * socket would block (whatever's left is kept for the next call), or -1 if
+ * the socket has failed and should be closed.
+ */
+ssize_t ProtocolFlush(dPtr apDescriptor, string_view aText = string_view());
+
+/* Function: CompressEnd
+ *
+ * Finishes the MCCP stream after whatever output is already queued, so the
+ * client can go back to reading plain text.  CopyoverGet() calls this for
+ * you; otherwise call it before closing a socket you want to say something
+ * on, and then call ProtocolFlush().
+ */
+void CompressEnd(dPtr apDescriptor);
+
+/* Function: ProtocolFlushStats
+ *
+ * Returns the running totals for ProtocolFlush(), for a stats command.  The
+ * syscall count includes the setsockopt() calls used to cork the socket.
+ */
+const flush_stats_t& ProtocolFlushStats(void);
+
 /******************************************************************************
  Copyover save/load functions.
  ******************************************************************************/
 
+/* Function: CopyoverPrepare
+ *
+ * Ends every player's MCCP stream and sends the end of them all together,
+ * waiting up to MCCP_FINISH_WAIT milliseconds in total.  Call it once before
+ * writing the copyover file; CopyoverGet() doesn't wait, and leaves out MCCP
+ * for anyone whose stream couldn't be finished.
+ */
+void CopyoverPrepare(void);
+
 /* Function: CopyoverGet
  *
  * Returns the protocol values stored as a short string.  If your mud uses
@@ -342,18 +620,35 @@ const char* CopyoverGet(dPtr apDescriptor);
  *
  * Call this function for each player after a copyover, passing in the string
  * you added to the temporary text file.  This will restore their protocol
- * settings, and automatically renegotiate MSDP/GMCP.
+ * settings, and automatically renegotiate MSDP/GMCP unless CopyoverLoad() has
+ * already restored them.
  *
  * Note that the client doesn't recognise a copyover, and therefore refuses to
  * renegotiate certain telnet options (to avoid loops), so they really need to
- * be saved.  However MSDP/GMCP is handled through scripts, and we don't want
- * to have to save all of the REPORT variables, so it's easier to renegotiate.
- *
- * Client name and version are not saved.  It is recommended you save these in
- * the player file, as then you can grep to collect client usage stats.
+ * be saved.  Renegotiating MSDP/GMCP works, but every client then sends its
+ * Core.Supports and REPORTs at once, which is why the snapshot is better.
  */
 void CopyoverSet(dPtr apDescriptor, const char* apData);
 
+/* Function: CopyoverSave
+ *
+ * Writes a binary snapshot of everything else the protocol knows about the
+ * player to the file: the GMCP modules, MSDP REPORTs, client name and version,
+ * MXP version and the last value sent for each variable.  Call it for each
+ * player as well as CopyoverGet(), with a second file kept alongside the
+ * copyover file.  Returns false if it couldn't be written.
+ */
+bool CopyoverSave(dPtr apDescriptor, FILE* apFile);
+
+/* Function: CopyoverLoad
+ *
+ * Call this for each player after a copyover, before CopyoverSet(), with the
+ * file written by CopyoverSave().  The player's snapshot is found by socket,
+ * so it doesn't matter if some players didn't make it.  Returns false if
+ * there wasn't a usable one, in which case CopyoverSet() renegotiates.
+ */
+bool CopyoverLoad(dPtr apDescriptor, FILE* apFile);
+
 /******************************************************************************
  GMCP functions.
  ******************************************************************************/
@@ -364,8 +659,64 @@ void CopyoverSet(dPtr apDescriptor, const char* apData);
  */
 void SendGMCPJ(dPtr apDescriptor, string apVariable, string apValue);
 
+/* Handles the payload of one GMCP package, which may be empty */
+typedef void (*gmcp_handler_t)(dPtr apDescriptor, string_view aPayload);
+
+/* Function: GMCPRegister
+ *
+ * Call this at startup to have aHandler called whenever a client sends the
+ * GMCP package (such as "Char.Items.Inv").  Package names aren't case
+ * sensitive, and registering a package again replaces its handler.  The name
+ * isn't copied, so it should be a string literal.
+ *
+ * Unregistered packages are ignored without their payloads being parsed.
+ */
+void GMCPRegister(const char* apPackage, gmcp_handler_t aHandler);
+
+/* Function: GMCPSupports
+ *
+ * Returns true if the client has asked for the GMCP module with Core.Supports.
+ * Use the gmcp_module_t version where possible, as it's a single bit test; the
+ * string version has to look the name up first.
+ */
+bool GMCPSupports(dPtr d, gmcp_module_t aModule);
 bool GMCPSupports(dPtr d, const char* module);
 
+/* Function: GMCPEncode
+ *
+ * Frames the JSON value as a GMCP message for apVariable, ready to be sent to
+ * any number of descriptors with GMCPSendPayload() or GMCPBroadcast().  Use
+ * this for anything that goes to more than one player, so the JSON is only
+ * serialised once.
+ */
+gmcp_payload_t GMCPEncode(const char* apVariable, string_view aValue);
+
+/* Function: GMCPSendPayload
+ *
+ * Sends a message from GMCPEncode() to the descriptor, if it's using GMCP.
+ */
+void GMCPSendPayload(dPtr apDescriptor, const gmcp_payload_t& apPayload);
+
+/* Function: GMCPBroadcast
+ *
+ * Sends a message from GMCPEncode() to every descriptor in the container that
+ * supports the GMCP module (such as eGMCP_ROOM for a Room.Info message).  The
+ * module can be a gmcp_module_t or a name.
+ *
+ * For example:
+ *
+ * gmcp_payload_t pInfo = GMCPEncode("Room.Info", Info.dump());
+ * GMCPBroadcast(descriptor_list, eGMCP_ROOM, pInfo);
+ */
+template <typename Container, typename Module>
+void GMCPBroadcast(const Container& aDescriptors, Module aModule, const gmcp_payload_t& apPayload)
+{
+  for (dPtr pDescriptor : aDescriptors) {
+    if (GMCPSupports(pDescriptor, aModule))
+      GMCPSendPayload(pDescriptor, apPayload);
+  }
+}
+
 /******************************************************************************
  OOB functions.
  ******************************************************************************/
@@ -378,6 +729,15 @@ bool GMCPSupports(dPtr d, const char* module);
  */
 void OOBUpdate(dPtr apDescriptor);
 
+/* Function: OOBUpdateAll
+ *
+ * Calls OOBUpdate() for every descriptor that has something to send, and
+ * skips the rest.  Descriptors are remembered as their variables are set, so
+ * call this once per second after setting everyone's variables, instead of
+ * calling OOBUpdate() for each descriptor.
+ */
+void OOBUpdateAll(void);
+
 /* Function: OOBFlush
  *
  * Works like OOBUpdate(), except only flushes a specific variable.  The
@@ -453,6 +813,74 @@ void OOBSetTable(dPtr apDescriptor, variable_t aOOB, const char* apValue);
  */
 void OOBSetArray(dPtr apDescriptor, variable_t aOOB, const char* apValue);
 
+/******************************************************************************
+ MCCP functions.
+ ******************************************************************************/
+
+/* Function: CompressSetProfile
+ *
+ * Changes the settings for a connection class.  Set CompressClass in the
+ * protocol structure before MCCP starts to choose which one a user gets.
+ * Streams that have already started keep the settings they started with.
+ *
+ * A dictionary only works with clients that use the same one, as standard
+ * MCCP clients can't be told about it, so leave it empty for normal play.
+ */
+void CompressSetProfile(compress_class_t aClass, const compress_profile_t& aProfile);
+const compress_profile_t& CompressGetProfile(compress_class_t aClass);
+
+/* Function: z_alloc, z_free
+ *
+ * The allocator for every zlib stream.  Freed blocks are kept, up to
+ * MAX_ZLIB_POOL bytes, and handed to the next stream that wants the same
+ * size - which is usually all of them, as each stream asks for the same few
+ * blocks.  If your mud has its own versions in comm.c, remove them.
+ */
+void* z_alloc(void* opaque, uInt items, uInt size);
+void z_free(void* opaque, void* address);
+
+/* Function: CompressReserve
+ *
+ * Fills the pool with enough memory for aStreams streams of the given class,
+ * so that everyone starting MCCP at once (after a reboot or copyover, for
+ * example) doesn't all go to malloc at the same time.
+ */
+void CompressReserve(compress_class_t aClass, int aStreams);
+
+/* Function: ZlibPoolStats
+ *
+ * Returns the allocator's running totals, for a stats command.
+ */
+zlib_pool_stats_t ZlibPoolStats(void);
+
+/* Function: CompressBuildDictionary
+ *
+ * Builds a preset dictionary of up to aMaxSize bytes (at most 32K) from
+ * samples of real output, such as a log of what was sent each pulse.  The
+ * GMCP message headers and keys are always included.
+ */
+string CompressBuildDictionary(const vector<string>& aSamples, size_t aMaxSize);
+
+/* Function: CompressBenchmark
+ *
+ * Compresses the samples with each profile, flushing after each sample as a
+ * pulse of output would, and returns a table of the ratio, CPU time per MB
+ * and memory per stream.  If a dictionary is given, each profile is tried
+ * with it as well.
+ */
+string CompressBenchmark(const vector<string>& aSamples, const string& aDictionary);
+
+/* Function: CompressCheck
+ *
+ * Runs a connection over a local socket pair through the real MCCP path: it
+ * starts compression, flushes several pulses of output, then ends the stream
+ * the way a copyover does and sends some plain text after it.  The other end
+ * is inflated with zlib as a client would, and it returns true if that gets
+ * back exactly what was sent.  Worth calling at boot, or from a test command,
+ * after changing any of the MCCP code.
+ */
+bool CompressCheck(void);
+
 /******************************************************************************
  MSSP functions.
  ******************************************************************************/
@@ -460,10 +888,38 @@ void OOBSetArray(dPtr apDescriptor, variable_t aOOB, const char* apValue);
 /* Function: MSSPSetPlayers
  *
  * Stores the current number of players.  The first time it's called, it also
- * stores the uptime.
+ * stores the uptime.  The MSSP response is encoded once and shared by every
+ * request, and only encoded again when the players or the size of the world
+ * change, so this can be called as often as you like.
  */
 void MSSPSetPlayers(int aPlayers);
 
+/* Function: MSSPProbeAccept
+ *
+ * Call this from new_descriptor() for each socket as soon as it's accepted,
+ * before a descriptor is created for it.  If it returns true the socket has
+ * been taken over, and will be answered from the cached MSSP table: the mud
+ * should forget about it, and not create a descriptor for it.
+ *
+ * If abDedicated is true, the socket came from a port that only serves MSSP,
+ * so it's always taken over and offered MSSP.  This is the only way to keep
+ * crawlers off the descriptor list, and it's the one to use.
+ *
+ * On the main port it only takes over a peer that has already sent IAC DO
+ * MSSP or MSSP-REQUEST by the time it's accepted.  Most crawlers wait for the
+ * mud's IAC WILL MSSP first, so they still get a descriptor as usual (and the
+ * cached table once they ask).  Anything else is left alone and returns false.
+ */
+bool MSSPProbeAccept(int aSocket, bool abDedicated);
+
+/* Function: MSSPProbeUpdate
+ *
+ * Call this once per pass of game_loop().  It reads the requests from, and
+ * writes the replies to, the sockets taken over by MSSPProbeAccept(), and
+ * closes them once they're done or after MSSP_PROBE_TIMEOUT seconds.
+ */
+void MSSPProbeUpdate(void);
+
 /******************************************************************************
  MXP functions.
  ******************************************************************************/